@@ -1,13 +1,22 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <math.h>
 #include <thread>
 #include <assert.h>
 #include <future>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <chrono>
 #include "dle.h"
+#include "dle_internal.h"
 
 
 namespace dle {
 
-	static int g_sintable[360] = {
+	int g_sintable[360] = {
 		0, 174, 348, 523, 697, 871, 1045, 1218, 1391, 1564, 1736, 1908, 2079, 2249, 2419, 2588, 2756, 2923, 3090, 3255,
 		3420, 3583, 3746, 3907, 4067, 4226, 4383, 4539, 4694, 4848, 4999, 5150, 5299, 5446, 5591, 5735, 5877, 6018, 6156,
 		6293, 6427, 6560, 6691, 6819, 6946, 7071, 7193, 7313, 7431, 7547, 7660, 7771, 7880, 7986, 8090, 8191, 8290, 8386,
@@ -30,6 +39,17 @@ namespace dle {
 		-4383, -4226, -4067, -3907, -3746, -3583, -3420, -3255, -3090, -2923, -2756, -2588, -2419, -2249, -2079, -1908,
 		-1736, -1564, -1391, -1218, -1045, -871, -697, -523, -348, -174 };
 
+	static unsigned int g_threadCount = 0;
+
+	void setThreadCount(const unsigned int count) {
+		g_threadCount = count;
+	}
+
+	unsigned int getThreadCount() {
+		if (g_threadCount) return g_threadCount;
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
 	inline int min(int a, int b) {
 		return a + (((b - a) >> 31) & (b - a));
 	}
@@ -74,432 +94,2475 @@ namespace dle {
 		out.a = dle::max(a.a, b.a);
 	}
 
-	void blend(Color& out, const Color& dst, const Color& src, const eBlendMode& blendmode) {
-		Color tmpDst;
-		Color tmpOut;
-		switch (blendmode) {
-		case kBlendMode_Normal:
-			tmpOut.r = src.r;
-			tmpOut.g = src.g;
-			tmpOut.b = src.b;
-			tmpOut.a = dle::min(255, dst.a + src.a);
-
-			// Lerp final alpha composite
-			lerp(out, dst, tmpOut, src.a);
-			break;
-		case kBlendMode_Multiply:
-			tmpOut.r = dst.r * src.r / 255;
-			tmpOut.g = dst.g * src.g / 255;
-			tmpOut.b = dst.b * src.b / 255;
-			tmpOut.a = dle::min(255, dst.a + src.a);
-
-			// Lerp final alpha composite
-			lerp(out, dst, tmpOut, src.a);
-			break;
-		case kBlendMode_Screen:
-			// First, we want to make the dst color the same as our src color in the case
-			// of the alpha being very low. Because images might be black and we end up with black
-			// shadow. And we don't want that
-			lerpPreserveAlpha(tmpDst, src, dst, dst.a);
-
-			// This is screen in photoshop. It's not a real additive. But it gives a better result
-			// 1 - (1 - a) * (1 - b)
-			tmpOut.r = 255 - (255 - dst.r) * (255 - src.r) / 255;
-			tmpOut.g = 255 - (255 - dst.g) * (255 - src.g) / 255;
-			tmpOut.b = 255 - (255 - dst.b) * (255 - src.b) / 255;
-			tmpOut.a = dle::min(255, dst.a + src.a);
-
-			// Lerp final alpha composite
-			lerp(out, tmpDst, tmpOut, src.a);
-			break;
-		}
+	// Non separable blend modes work on 8.8 fixed point channels, so the rounding
+	// of the luminance doesn't get amplified when colors are pulled back in range.
+	// Luminance weights are 0.3, 0.59 and 0.11 in 16 bits, 8 bits weights are off
+	// by up to a fifth of a step on saturated colors
+	inline int lum88(const unsigned int r, const unsigned int g, const unsigned int b) {
+		// 8.8 channels, at most 65280, keep the sum in 32 bits
+		return (int) ((19661u * r + 38666u * g + 7209u * b + 32768u) >> 16);
 	}
 
+	inline int lum(const int r, const int g, const int b) {
+		return (19661 * r + 38666 * g + 7209 * b + 128) >> 8;
+	}
 
-	ColorOverlay::ColorOverlay(const Color& in_color, const eBlendMode in_blendMode) :
-		color(in_color), blendMode(in_blendMode) {}
+	// Luminance in hundredths, exact, to compare colors
+	inline int lumOrder(const Color& color) {
+		return 30 * color.r + 59 * color.g + 11 * color.b;
+	}
 
-	void overlayPS(Color* dst, Color* src, const Color* end, const ColorOverlay& effect) {
-		const dle::eBlendMode blendMode = effect.blendMode;
-		while (src != end) {
-			blend(*dst, *src, effect.color, blendMode);
+	inline int sat(const Color& color) {
+		return dle::max(color.r, dle::max(color.g, color.b)) - dle::min(color.r, dle::min(color.g, color.b));
+	}
 
-			dst->a = src->a; // Mask overlay
-			++src; ++dst;
-		}
+	// Factor stretching a color of saturation spread to the saturation s, in 16.16
+	inline unsigned int satFactor(const int s, const int spread) {
+		return spread ? ((unsigned int) s << 16) / (unsigned int) spread : 0;
 	}
 
-	void ColorOverlay::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		auto len = srcSize.width * srcSize.height;
-		auto threadCount = std::thread::hardware_concurrency();
-		std::vector<std::future<void>> workers;
-		unsigned int i;
-		for (i = 0; i < threadCount - 1; ++i) {
-			workers.push_back(std::async(dle::overlayPS, dst + len * i / threadCount, src + len * i / threadCount, src + len * (i + 1) / threadCount, *this));
-		}
-		dle::overlayPS(dst + len * i / threadCount, src + len * i / threadCount, src + len * (i + 1) / threadCount, *this);
-		for (auto& worker : workers) worker.wait();
+	// Color minus its minimum n, times the factor f. The result is in 8.8
+	inline void stretch(int& r, int& g, int& b, const Color& color, const int n, const unsigned int f) {
+		r = (int) ((unsigned int) (color.r - n) * f >> 8);
+		g = (int) ((unsigned int) (color.g - n) * f >> 8);
+		b = (int) ((unsigned int) (color.b - n) * f >> 8);
 	}
 
+	// Stretch a color to the saturation s: its minimum goes to 0 and its maximum
+	// to s. The result is in 8.8
+	inline void setSat(int& r, int& g, int& b, const Color& color, const int s) {
+		const int n = dle::min(color.r, dle::min(color.g, color.b));
+		dle::stretch(r, g, b, color, n, dle::satFactor(s, dle::sat(color)));
+	}
 
-	Blur::Blur(const int in_size) : size(in_size) {}
+	// 8.8 channels in range, rounded to 8 bits
+	inline void roundChannels(Color& out, const int r, const int g, const int b) {
+		out.r = (r + 128) >> 8;
+		out.g = (g + 128) >> 8;
+		out.b = (b + 128) >> 8;
+	}
 
-	void Blur::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
+	// Pull 8.8 channels toward the luminance l by the 16.16 factor f, so they fit.
+	// The factor rounds down, channels land in [-1, 65280] and round in range
+	inline void pullToLum(Color& out, const int r, const int g, const int b, const int l, const long long f) {
+		dle::roundChannels(out, l + (int) ((r - l) * f >> 16), l + (int) ((g - l) * f >> 16), l + (int) ((b - l) * f >> 16));
+	}
 
-		int accum[4];
-		int sizeTotal = size * 2 + 1;
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
+	// Reciprocal of den rounded up in 16.48, for divide()
+	inline unsigned long long reciprocal(const unsigned int den) {
+		return den ? ((1ull << 48) + den - 1) / den : 0;
+	}
 
-		// Blur U
-		Color* pCur = src + size;
-		Color* pLookup = src;
-		Color* pLookupIter;
-		Color* pEnd = src + srcSize.width * srcSize.height - size;
-		Color* pDst = blurImg + size;
-		while (pCur != pEnd) {
-			accum[0] = pLookup->r;
-			accum[1] = pLookup->g;
-			accum[2] = pLookup->b;
-			accum[3] = pLookup->a;
+	// (num << 16) / den rounded down, from rcp = reciprocal(den). Exact for num
+	// and den under 2^16, the rounding of rcp adds less than num * den / 2^32
+	inline long long divide(const unsigned int num, const unsigned long long rcp) {
+		return (long long) (num * rcp >> 32);
+	}
 
-			pLookupIter = pLookup + 1;
-			for (int i = 1; i < sizeTotal; ++i, ++pLookupIter) {
-				accum[0] += pLookupIter->r;
-				accum[1] += pLookupIter->g;
-				accum[2] += pLookupIter->b;
-				accum[3] += pLookupIter->a;
-			}
+	// Color with the luminance l, keeping the hue and saturation if they fit in
+	// range. Channels and luminance are in 8.8
+	inline void setLum(Color& out, int r, int g, int b, const int l) {
+		const int d = l - dle::lum88(r, g, b);
+		r += d;
+		g += d;
+		b += d;
+
+		// Shifted colors keep their spread, so only one side can be out of range.
+		// Neighbour pixels mostly agree on this, skipping the division is worth
+		// the branch
+		const int n = dle::min(r, dle::min(g, b));
+		const int x = dle::max(r, dle::max(g, b));
+		if (n < 0) dle::pullToLum(out, r, g, b, l, ((unsigned int) l << 16) / (unsigned int) (l - n));
+		else if (x > 65280) dle::pullToLum(out, r, g, b, l, ((unsigned int) (65280 - l) << 16) / (unsigned int) (x - l));
+		else dle::roundChannels(out, r, g, b);
+	}
 
-			pDst->r = accum[0] / sizeTotal;
-			pDst->g = accum[1] / sizeTotal;
-			pDst->b = accum[2] / sizeTotal;
-			pDst->a = accum[3] / sizeTotal;
+	// Composite the blended color of a non separable mode. Like with screen, the
+	// blended color fades to the source color where the destination is transparent.
+	// Opaque sources leave it as it is, without the lerp
+	inline void nonSeparableComposite(Color& out, const Color& dst, const Color& src, Color& blended) {
+		if (dst.a != 255) lerpPreserveAlpha(blended, src, blended, dst.a);
+		blended.a = dle::min(255, dst.a + src.a);
+		if (src.a == 255) out = blended;
+		else lerp(out, dst, blended, src.a);
+	}
 
-			++pCur;
-			++pLookup;
-			++pDst;
-		}
+	// One function per blend mode, so the row loops get a copy of the loop per mode
+	inline void blendNormal(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		tmpOut.r = src.r;
+		tmpOut.g = src.g;
+		tmpOut.b = src.b;
+		tmpOut.a = dle::min(255, dst.a + src.a);
 
-		// Blur V
-		pCur = blurImg + size * srcSize.width;
-		pLookup = blurImg;
-		pLookupIter;
-		pEnd = blurImg + srcSize.width * srcSize.height - size * srcSize.width;
-		pDst = dst + size * srcSize.width;
-		while (pCur != pEnd) {
-			accum[0] = pLookup->r;
-			accum[1] = pLookup->g;
-			accum[2] = pLookup->b;
-			accum[3] = pLookup->a;
+		// Lerp final alpha composite
+		lerp(out, dst, tmpOut, src.a);
+	}
 
-			pLookupIter = pLookup + srcSize.width;
-			for (int i = 1; i < sizeTotal; ++i, pLookupIter += srcSize.width) {
-				accum[0] += pLookupIter->r;
-				accum[1] += pLookupIter->g;
-				accum[2] += pLookupIter->b;
-				accum[3] += pLookupIter->a;
-			}
+	inline void blendMultiply(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		tmpOut.r = dst.r * src.r / 255;
+		tmpOut.g = dst.g * src.g / 255;
+		tmpOut.b = dst.b * src.b / 255;
+		tmpOut.a = dle::min(255, dst.a + src.a);
 
-			pDst->r = accum[0] / sizeTotal;
-			pDst->g = accum[1] / sizeTotal;
-			pDst->b = accum[2] / sizeTotal;
-			pDst->a = accum[3] / sizeTotal;
+		// Lerp final alpha composite
+		lerp(out, dst, tmpOut, src.a);
+	}
 
-			++pCur;
-			++pLookup;
-			++pDst;
-		}
+	inline void blendScreen(Color& out, const Color& dst, const Color& src) {
+		Color tmpDst;
+		Color tmpOut;
 
-		delete[] blurImg;
+		// First, we want to make the dst color the same as our src color in the case
+		// of the alpha being very low. Because images might be black and we end up with black
+		// shadow. And we don't want that.
+		lerpPreserveAlpha(tmpDst, src, dst, dst.a);
+
+		// This is screen in photoshop. It's not a real additive. But it gives a better result
+		// 1 - (1 - a) * (1 - b)
+		tmpOut.r = 255 - (255 - dst.r) * (255 - src.r) / 255;
+		tmpOut.g = 255 - (255 - dst.g) * (255 - src.g) / 255;
+		tmpOut.b = 255 - (255 - dst.b) * (255 - src.b) / 255;
+		tmpOut.a = dle::min(255, dst.a + src.a);
+
+		// Lerp final alpha composite
+		lerp(out, tmpDst, tmpOut, src.a);
 	}
 
+	inline void blendHue(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		int r, g, b;
+		dle::setSat(r, g, b, src, dle::sat(dst));
+		dle::setLum(tmpOut, r, g, b, dle::lum(dst.r, dst.g, dst.b));
+		nonSeparableComposite(out, dst, src, tmpOut);
+	}
 
+	inline void blendSaturation(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		int r, g, b;
+		dle::setSat(r, g, b, dst, dle::sat(src));
+		dle::setLum(tmpOut, r, g, b, dle::lum(dst.r, dst.g, dst.b));
+		nonSeparableComposite(out, dst, src, tmpOut);
+	}
 
-	Outline::Outline(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
-		color(in_color), size(in_size), blendMode(in_blendMode) {}
+	inline void blendColor(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		dle::setLum(tmpOut, src.r << 8, src.g << 8, src.b << 8, dle::lum(dst.r, dst.g, dst.b));
+		nonSeparableComposite(out, dst, src, tmpOut);
+	}
 
-	void Outline::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		// We create a blur first
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
-		memset(blurImg, 0, sizeof(Color) * srcSize.width * srcSize.height);
-		dle::Blur fxBlur(size);
-		fxBlur.apply(NULL, blurImg, src, srcSize);
+	inline void blendLuminosity(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut;
+		dle::setLum(tmpOut, dst.r << 8, dst.g << 8, dst.b << 8, dle::lum(src.r, src.g, src.b));
+		nonSeparableComposite(out, dst, src, tmpOut);
+	}
 
-		// Use the blur to create our outline
-		Color* pEnd = blurImg + srcSize.width * srcSize.height;
-		Color* pBlurPx = blurImg;
-		Color final = color;
-		int sizeP2 = 1;
-		while (sizeP2 < size) sizeP2 *= 2;
-		if (sizeP2 > 32) sizeP2 = 32;
-		int divider = 32 / sizeP2;
-		int multiplier = 8 * sizeP2;
-		while (pBlurPx != pEnd) {
-			// Some magic to transform the blur into outline
-			final.a = dle::clamp(pBlurPx->a, 0, divider);
-			final.a = dle::min(255, final.a * multiplier);
-			final.a = (final.a * color.a) / 255;
-			blend(*baseLayer, *baseLayer, final, blendMode); // Blend direction to base layer.
-			++pBlurPx; ++src; ++baseLayer;
-		}
+	inline void blendDarkerColor(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut = dle::lumOrder(src) < dle::lumOrder(dst) ? src : dst;
+		nonSeparableComposite(out, dst, src, tmpOut);
+	}
 
-		delete[] blurImg;
+	inline void blendLighterColor(Color& out, const Color& dst, const Color& src) {
+		Color tmpOut = dle::lumOrder(src) > dle::lumOrder(dst) ? src : dst;
+		nonSeparableComposite(out, dst, src, tmpOut);
 	}
 
+	void blend(Color& out, const Color& dst, const Color& src, const eBlendMode& blendmode) {
+		switch (blendmode) {
+		case kBlendMode_Normal: dle::blendNormal(out, dst, src); break;
+		case kBlendMode_Multiply: dle::blendMultiply(out, dst, src); break;
+		case kBlendMode_Screen: dle::blendScreen(out, dst, src); break;
+		case kBlendMode_Hue: dle::blendHue(out, dst, src); break;
+		case kBlendMode_Saturation: dle::blendSaturation(out, dst, src); break;
+		case kBlendMode_Color: dle::blendColor(out, dst, src); break;
+		case kBlendMode_Luminosity: dle::blendLuminosity(out, dst, src); break;
+		case kBlendMode_DarkerColor: dle::blendDarkerColor(out, dst, src); break;
+		case kBlendMode_LighterColor: dle::blendLighterColor(out, dst, src); break;
+		default: break;
+		}
+	}
 
-	Shadow::Shadow(const Color& in_color, const Offset& in_offset, const int in_size, const eBlendMode in_blendMode) :
-		color(in_color), offset(in_offset), size(in_size), blendMode(in_blendMode) {}
+	// Pixels blended at a time by the loops that build their colors in a buffer first
+	static const int BLEND_CHUNK_SIZE = 4096;
 
-	void Shadow::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		// We create a blur first
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
-		memset(blurImg, 0, sizeof(Color) * srcSize.width * srcSize.height);
-		dle::Blur fxBlur(size);
-		fxBlur.apply(NULL, blurImg, src, srcSize);
+	template <void (*BlendFn)(Color&, const Color&, const Color&)>
+	void blendRowT(Color* out, const Color* dst, const Color* src, const int srcStep, const int count) {
+		const Color* end = dst + count;
+		while (dst != end) {
+			BlendFn(*out, *dst, *src);
+			++out; ++dst; src += srcStep;
+		}
+	}
 
-		// Use the blur to create our shadow, using the offset
-		Color* pEnd;
-		Color* pBlurPx = blurImg;
-		Color final = color;
-		if (offset.x < 0) {
-			pBlurPx -= offset.x;
-			pEnd = baseLayer + srcSize.width * srcSize.height + offset.x;
+	// Non separable modes of a single source color, the same as blend() per pixel.
+	// Where the source color is set to the luminance of dst, SetLum's divisions
+	// only depend on the source side, their reciprocals are worked out once
+	struct SourceLum {
+		int r, g, b;		// 8.8 source channels
+		int lum;			// Their luminance
+		int max;			// Their maximum
+		unsigned long long rcpUnder;	// Reciprocal of lum - minimum, for colors shifted under 0
+		unsigned long long rcpOver;		// Reciprocal of max - lum, for colors shifted over 255
+	};
+
+	inline void initSourceLum(SourceLum& source, const int r, const int g, const int b, const int n) {
+		source.r = r;
+		source.g = g;
+		source.b = b;
+		source.lum = dle::lum88(r, g, b);
+		source.max = dle::max(r, dle::max(g, b));
+		source.rcpUnder = dle::reciprocal(source.lum - n);
+		source.rcpOver = dle::reciprocal(source.max - source.lum);
+	}
+
+	// setLum of a source color to l. Shifted by l - lum, the minimum goes under 0
+	// when l < lum - minimum, the maximum over 255 when l > 255 - (max - lum)
+	inline void setSourceLum(Color& out, const SourceLum& source, const int n, const int l) {
+		const int d = l - source.lum;
+		const int r = source.r + d;
+		const int g = source.g + d;
+		const int b = source.b + d;
+		if (n + d < 0) dle::pullToLum(out, r, g, b, l, dle::divide(l, source.rcpUnder));
+		else if (source.max + d > 65280) dle::pullToLum(out, r, g, b, l, dle::divide(65280 - l, source.rcpOver));
+		else dle::roundChannels(out, r, g, b);
+	}
+
+	// The source is stretched to Sat(dst), one of 256 colors
+	void blendRowHue(Color* out, const Color* dst, const Color& src, const int count) {
+		const Color color = src; // src can be in out
+		const int n = dle::min(color.r, dle::min(color.g, color.b));
+		const int spread = dle::sat(color);
+		SourceLum sources[256];
+		for (int s = 0; s < 256; ++s) {
+			int r, g, b;
+			dle::stretch(r, g, b, color, n, dle::satFactor(s, spread));
+			dle::initSourceLum(sources[s], r, g, b, 0);
 		}
-		else {
-			baseLayer += offset.x;
-			src += offset.x;
-			pEnd = baseLayer + srcSize.width * srcSize.height;
+
+		const Color* end = dst + count;
+		Color tmpOut;
+		while (dst != end) {
+			dle::setSourceLum(tmpOut, sources[dle::sat(*dst)], 0, dle::lum(dst->r, dst->g, dst->b));
+			nonSeparableComposite(*out, *dst, color, tmpOut);
+			++out; ++dst;
 		}
-		if (offset.y < 0) {
-			pBlurPx -= offset.y * srcSize.width;
-			pEnd += offset.y * srcSize.width;
+	}
+
+	void blendRowColor(Color* out, const Color* dst, const Color& src, const int count) {
+		const Color color = src; // src can be in out
+		const int n = dle::min(color.r, dle::min(color.g, color.b)) << 8;
+		SourceLum source;
+		dle::initSourceLum(source, color.r << 8, color.g << 8, color.b << 8, n);
+
+		const Color* end = dst + count;
+		Color tmpOut;
+		while (dst != end) {
+			dle::setSourceLum(tmpOut, source, n, dle::lum(dst->r, dst->g, dst->b));
+			nonSeparableComposite(*out, *dst, color, tmpOut);
+			++out; ++dst;
 		}
-		else {
-			baseLayer += offset.y * srcSize.width;
-			src += offset.y * srcSize.width;
+	}
+
+	void blendRow(Color* out, const Color* dst, const Color* src, const int srcStep, const int count, const eBlendMode& blendMode) {
+		// The tables take 256 divisions, the rows save one per pixel
+		if (srcStep == 0 && count > 256) {
+			if (blendMode == kBlendMode_Hue) return dle::blendRowHue(out, dst, *src, count);
+			if (blendMode == kBlendMode_Color) return dle::blendRowColor(out, dst, *src, count);
 		}
-		while (baseLayer != pEnd) {
-			final.a = (pBlurPx->a * color.a) / 255;
-			blend(*baseLayer, *baseLayer, final, blendMode); // Blend direction to base layer.
-			++baseLayer; ++src; ++pBlurPx;
+		switch (blendMode) {
+		case kBlendMode_Normal: dle::blendRowT<dle::blendNormal>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Multiply: dle::blendRowT<dle::blendMultiply>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Screen: dle::blendRowT<dle::blendScreen>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Hue: dle::blendRowT<dle::blendHue>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Saturation: dle::blendRowT<dle::blendSaturation>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Color: dle::blendRowT<dle::blendColor>(out, dst, src, srcStep, count); break;
+		case kBlendMode_Luminosity: dle::blendRowT<dle::blendLuminosity>(out, dst, src, srcStep, count); break;
+		case kBlendMode_DarkerColor: dle::blendRowT<dle::blendDarkerColor>(out, dst, src, srcStep, count); break;
+		case kBlendMode_LighterColor: dle::blendRowT<dle::blendLighterColor>(out, dst, src, srcStep, count); break;
+		default: break;
 		}
+	}
+
 
-		delete[] blurImg;
+	// Scale a distance in pixels for a downscaled image. Non zero distances stay non zero
+	inline int scaleDistance(const int distance, const int factor) {
+		if (distance <= 0) return distance;
+		return dle::max(1, (distance + factor / 2) / factor);
 	}
 
+	inline Offset scaleOffset(const Offset& offset, const int factor) {
+		Offset result;
+		result.x = (offset.x >= 0 ? offset.x + factor / 2 : offset.x - factor / 2) / factor;
+		result.y = (offset.y >= 0 ? offset.y + factor / 2 : offset.y - factor / 2) / factor;
+		return result;
+	}
 
+	// Interpolation of the animated effect parameters
+	inline int interpolate(const int from, const int to, const float t) {
+		return from + (int) floorf((float) (to - from) * t + .5f);
+	}
 
-	InnerShadow::InnerShadow(const Color& in_color, const Offset& in_offset, const int in_size, const eBlendMode in_blendMode) :
-		color(in_color), offset(in_offset), size(in_size), blendMode(in_blendMode) {}
+	inline Color interpolate(const Color& from, const Color& to, const float t) {
+		Color result;
+		result.r = interpolate(from.r, to.r, t);
+		result.g = interpolate(from.g, to.g, t);
+		result.b = interpolate(from.b, to.b, t);
+		result.a = interpolate(from.a, to.a, t);
+		return result;
+	}
 
-	void InnerShadow::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		// We create a blur first
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
-		memset(blurImg, 0, sizeof(Color) * srcSize.width * srcSize.height);
-		dle::Blur fxBlur(size);
-		fxBlur.apply(NULL, blurImg, src, srcSize);
+	inline Offset interpolate(const Offset& from, const Offset& to, const float t) {
+		Offset result;
+		result.x = interpolate(from.x, to.x, t);
+		result.y = interpolate(from.y, to.y, t);
+		return result;
+	}
 
-		// Use the blur to create our shadow, using the offset
-		Color* pEnd;
-		Color* pBlurPx = blurImg;
-		Color final = color;
-		if (offset.x < 0) {
-			pBlurPx -= offset.x;
-			pEnd = dst + srcSize.width * srcSize.height + offset.x;
-		}
-		else {
-			dst += offset.x;
-			src += offset.x;
-			pEnd = dst + srcSize.width * srcSize.height;
+	inline Size interpolate(const Size& from, const Size& to, const float t) {
+		Size result;
+		result.width = interpolate(from.width, to.width, t);
+		result.height = interpolate(from.height, to.height, t);
+		return result;
+	}
+
+	// Keys are interpolated one by one. Gradients with a different key count switch half way
+	std::vector<GradientKey> interpolate(const std::vector<GradientKey>& from, const std::vector<GradientKey>& to, const float t) {
+		if (from.size() != to.size()) return t < .5f ? from : to;
+		std::vector<GradientKey> result(from.size());
+		for (size_t i = 0; i < from.size(); ++i) {
+			result[i].color = interpolate(from[i].color, to[i].color, t);
+			result[i].percent = interpolate(from[i].percent, to[i].percent, t);
 		}
-		if (offset.y < 0) {
-			pBlurPx -= offset.y * srcSize.width;
-			pEnd += offset.y * srcSize.width;
+		return result;
+	}
+
+	// Angles turn the shortest way
+	inline int interpolateAngle(const int from, const int to, const float t) {
+		const int delta = wrapAngle(to - from + 180) - 180;
+		return wrapAngle(from + interpolate(0, delta, t));
+	}
+
+	// Split the rows [yStart, yEnd) across threads, the same way for every effect pass
+	template<typename Fn> void splitRows(const int yStart, const int yEnd, Fn fn) {
+		const int height = yEnd - yStart;
+		auto threadCount = dle::getThreadCount();
+		std::vector<std::future<void>> workers;
+		unsigned int i;
+		for (i = 0; i < threadCount - 1; ++i) {
+			workers.push_back(std::async(std::launch::async, fn, yStart + (int) (height * i / threadCount), yStart + (int) (height * (i + 1) / threadCount)));
 		}
-		else {
-			dst += offset.y * srcSize.width;
-			src += offset.y * srcSize.width;
+		fn(yStart + (int) (height * i / threadCount), yStart + (int) (height * (i + 1) / threadCount));
+		for (auto& worker : workers) worker.wait();
+	}
+
+	// Runs another effect unchanged. Default result of Effect::scaled() and
+	// Effect::interpolated(), for effects that don't implement them.
+	class EffectReference final : public Effect {
+	public:
+		EffectReference(const Effect& in_effect) : effect(in_effect) {}
+		eEffectAccess getAccess() const { return effect.getAccess(); }
+		int getPassCount() const { return effect.getPassCount(); }
+		int getScratchSize(const Size& srcSize) const { return effect.getScratchSize(srcSize); }
+		int getAlphaBlurSize() const { return effect.getAlphaBlurSize(); }
+		Extent getExtent() const { return effect.getExtent(); }
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+			effect.applyRows(baseLayer, dst, src, scratch, srcSize, pass, yStart, yEnd);
 		}
-		while (dst != pEnd) {
-			final.a = ((255 - pBlurPx->a) * color.a) / 255;
-			final.a = final.a * src->a / 255;
-			blend(*dst, *src, final, blendMode);
-			++dst; ++src; ++pBlurPx;
+		Effect* scaled(const int factor) const { return effect.scaled(factor); }
+		Effect* interpolated(const Effect& to, const float t) const { return effect.interpolated(to, t); }
+		void applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+			effect.applyAlphaRows(baseLayer, srcAlpha, alphaStride, scratch, srcSize, pass, yStart, yEnd);
 		}
+	private:
+		const Effect& effect;
+	};
 
-		delete[] blurImg;
+	int Effect::getPassCount() const {
+		return 1;
 	}
 
+	int Effect::getScratchSize(const Size& srcSize) const {
+		return 0;
+	}
 
+	int Effect::getAlphaBlurSize() const {
+		return -1;
+	}
 
-	Glow::Glow(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
-		color(in_color), size(in_size), blendMode(in_blendMode) {}
+	Extent Effect::getExtent() const {
+		Extent extent = { 0, 0, 0, 0 };
+		return extent;
+	}
+
+	// Split the rows [yStart, yEnd) across threads like splitRows, each thread
+	// working by chunks of about 32k pixels. No chunk starts once cancelled is set.
+	// Returns false if the rows were cancelled
+	template<typename Fn> bool splitRowsCancellable(const int yStart, const int yEnd, const int width, const std::atomic<bool>& cancelled, Fn fn) {
+		const int chunkRows = dle::max(1, 32768 / dle::max(width, 1));
+		splitRows(yStart, yEnd, [&](int y0, int y1) {
+			for (int y = y0; y < y1 && !cancelled; y += chunkRows) {
+				fn(y, dle::min(y + chunkRows, y1));
+			}
+		});
+		return !cancelled;
+	}
+
+	// Run every pass of an effect across threads, until cancelled. Layers run
+	// effects through here rather than apply(), so effects that only implement
+	// apply() still find the layer in dst, see Effect::applyRows()
+	bool applyPasses(const Effect& effect, Color* baseLayer, Color* dst, Color* src, const Size& srcSize, const std::atomic<bool>& cancelled) {
+		std::vector<Color> scratch(effect.getScratchSize(srcSize));
+		const int passCount = effect.getPassCount();
+		for (int pass = 0; pass < passCount; ++pass) {
+			const bool done = splitRowsCancellable(0, srcSize.height, srcSize.width, cancelled, [&](int yStart, int yEnd) {
+				effect.applyRows(baseLayer, dst, src, scratch.data(), srcSize, pass, yStart, yEnd);
+			});
+			if (!done) return false;
+		}
+		return true;
+	}
 
-	void Glow::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
-		memset(blurImg, 0, sizeof(Color) * srcSize.width * srcSize.height);
-		dle::Blur fxBlur(size);
-		fxBlur.apply(NULL, blurImg, src, srcSize);
+	// Same as applyPasses, from the alpha of the layer only
+	bool applyAlphaPasses(const Effect& effect, Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, const Size& srcSize, const std::atomic<bool>& cancelled) {
+		std::vector<Color> scratch(effect.getScratchSize(srcSize));
+		const int passCount = effect.getPassCount();
+		for (int pass = 0; pass < passCount; ++pass) {
+			const bool done = splitRowsCancellable(0, srcSize.height, srcSize.width, cancelled, [&](int yStart, int yEnd) {
+				effect.applyAlphaRows(baseLayer, srcAlpha, alphaStride, scratch.data(), srcSize, pass, yStart, yEnd);
+			});
+			if (!done) return false;
+		}
+		return true;
+	}
 
-		Color* pBlurPx = blurImg;
-		Color* pEnd = baseLayer + srcSize.width * srcSize.height;
-		Color final = color;
-		while (baseLayer != pEnd) {
-			final.a = pBlurPx->a;
-			final.a = dle::clamp(final.a, 0, 128);
-			final.a = dle::min(255, final.a * 2);
-			final.a = final.a * color.a / 255;
-			blend(*baseLayer, *baseLayer, final, blendMode);
-			++baseLayer; ++src; ++pBlurPx;
+	// The default apply() runs applyRows(), whose default runs apply(). Each
+	// thread running the rows of a default apply() keeps its effect here, so an
+	// effect implementing neither stops there instead of overflowing the stack.
+	// VS2013 doesn't have thread_local
+#if defined(_MSC_VER) && _MSC_VER < 1900
+	static __declspec(thread) const Effect* t_defaultApply = NULL;
+#else
+	static thread_local const Effect* t_defaultApply = NULL;
+#endif
+
+	void Effect::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
+		std::vector<Color> scratch(getScratchSize(srcSize));
+		const int passCount = getPassCount();
+		for (int pass = 0; pass < passCount; ++pass) {
+			splitRows(0, srcSize.height, [&](int yStart, int yEnd) {
+				const Effect* previous = t_defaultApply;
+				t_defaultApply = this;
+				applyRows(baseLayer, dst, src, scratch.data(), srcSize, pass, yStart, yEnd);
+				t_defaultApply = previous;
+			});
 		}
+	}
+
+	void Effect::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		assert(t_defaultApply != this && "Effects must implement apply() or applyRows()");
+		if (t_defaultApply == this) return;
 
-		delete[] blurImg;
+		// Effects written for apply() get the layer in dst, like they always did
+		if (yStart > 0 || yEnd <= yStart) return;
+		if (dst != src) memcpy(dst, src, sizeof(Color) * srcSize.width * srcSize.height);
+		apply(baseLayer, dst, src, srcSize);
 	}
 
+	Effect* Effect::scaled(const int factor) const {
+		return new EffectReference(*this);
+	}
 
+	Effect* Effect::interpolated(const Effect& to, const float t) const {
+		return new EffectReference(t < .5f ? *this : to);
+	}
 
-	InnerGlow::InnerGlow(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
-		color(in_color), size(in_size), blendMode(in_blendMode) {}
+	void Effect::applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		assert(false && "Base layer effects must implement applyAlphaRows");
+	}
+
+	void Effect::applyAlpha(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, const Size& srcSize) const {
+		std::atomic<bool> cancelled(false);
+		applyAlphaPasses(*this, baseLayer, srcAlpha, alphaStride, srcSize, cancelled);
+	}
 
-	void InnerGlow::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		Color* blurImg = new Color[srcSize.width * srcSize.height];
-		memset(blurImg, 0, sizeof(Color) * srcSize.width * srcSize.height);
-		dle::Blur fxBlur(size);
-		fxBlur.apply(NULL, blurImg, src, srcSize);
 
-		Color* pBlurPx = blurImg;
-		Color* pEnd = dst + srcSize.width * srcSize.height;
-		Color final = color;
-		while (dst != pEnd) {
-			final.a = pBlurPx->a;
-			final.a = dle::clamp(final.a, 127, 255) - 127;
-			final.a = 255 - dle::min(255, final.a * 2);
-			final.a = final.a * color.a / 255;
-			final.a = final.a * src->a / 255;
-			blend(*dst, *dst, final, blendMode);
-			++dst; ++src; ++pBlurPx;
+	// Horizontal pass of the box blur, for the pixels of rows [yStart, yEnd).
+	// The window runs across row ends. The first and last size pixels of the
+	// image are not reached, they are cleared since the vertical pass reads them.
+	void blurU(Color* dst, const Color* src, const Size& srcSize, const int size, const int yStart, const int yEnd) {
+		const int len = srcSize.width * srcSize.height;
+		const int sizeTotal = size * 2 + 1;
+		const int iStart = yStart * srcSize.width;
+		const int iEnd = yEnd * srcSize.width;
+		const int blurStart = dle::max(iStart, size);
+		const int blurEnd = dle::min(iEnd, len - size);
+
+		for (int i = iStart; i < dle::min(iEnd, size); ++i) dst[i] = { 0, 0, 0, 0 };
+		for (int i = dle::max(iStart, len - size); i < iEnd; ++i) dst[i] = { 0, 0, 0, 0 };
+		if (blurStart >= blurEnd) return;
+
+		// Running sum of the window
+		int accum[4] = { 0, 0, 0, 0 };
+		const Color* pLookup = src + blurStart - size;
+		for (int i = 0; i < sizeTotal; ++i, ++pLookup) {
+			accum[0] += pLookup->r;
+			accum[1] += pLookup->g;
+			accum[2] += pLookup->b;
+			accum[3] += pLookup->a;
 		}
+		const Color* pOut = src + blurStart - size;
+		const Color* pIn = src + blurStart + size + 1;
+		Color* pDst = dst + blurStart;
+		Color* pDstEnd = dst + blurEnd;
+		while (true) {
+			pDst->r = accum[0] / sizeTotal;
+			pDst->g = accum[1] / sizeTotal;
+			pDst->b = accum[2] / sizeTotal;
+			pDst->a = accum[3] / sizeTotal;
+			if (++pDst == pDstEnd) break;
 
-		delete[] blurImg;
+			accum[0] += pIn->r - pOut->r;
+			accum[1] += pIn->g - pOut->g;
+			accum[2] += pIn->b - pOut->b;
+			accum[3] += pIn->a - pOut->a;
+			++pIn; ++pOut;
+		}
 	}
 
+	// Vertical pass of the box blur, for rows [yStart, yEnd). Only the rows at least
+	// size away from the top and bottom are written.
+	void blurV(Color* dst, const Color* src, const Size& srcSize, const int size, const int yStart, const int yEnd) {
+		const int w = srcSize.width;
+		const int sizeTotal = size * 2 + 1;
+		const int blurStart = dle::max(yStart, size);
+		const int blurEnd = dle::min(yEnd, srcSize.height - size);
+		if (blurStart >= blurEnd) return;
+
+		// Running sum of the window, per column
+		std::vector<int> accum(w * 4, 0);
+		for (int y = blurStart - size; y <= blurStart + size; ++y) {
+			const Color* pRow = src + y * w;
+			for (int x = 0; x < w; ++x) {
+				accum[x * 4 + 0] += pRow[x].r;
+				accum[x * 4 + 1] += pRow[x].g;
+				accum[x * 4 + 2] += pRow[x].b;
+				accum[x * 4 + 3] += pRow[x].a;
+			}
+		}
+		for (int y = blurStart; y < blurEnd; ++y) {
+			Color* pDst = dst + y * w;
+			for (int x = 0; x < w; ++x) {
+				pDst[x].r = accum[x * 4 + 0] / sizeTotal;
+				pDst[x].g = accum[x * 4 + 1] / sizeTotal;
+				pDst[x].b = accum[x * 4 + 2] / sizeTotal;
+				pDst[x].a = accum[x * 4 + 3] / sizeTotal;
+			}
+			if (y + 1 == blurEnd) break;
+			const Color* pIn = src + (y + size + 1) * w;
+			const Color* pOut = src + (y - size) * w;
+			for (int x = 0; x < w; ++x) {
+				accum[x * 4 + 0] += pIn[x].r - pOut[x].r;
+				accum[x * 4 + 1] += pIn[x].g - pOut[x].g;
+				accum[x * 4 + 2] += pIn[x].b - pOut[x].b;
+				accum[x * 4 + 3] += pIn[x].a - pOut[x].a;
+			}
+		}
+	}
 
-	Gradient::Gradient(const std::vector<GradientKey>& in_keys, int in_angle, const eBlendMode in_blendMode) :
-		keys(in_keys), angle(wrapAngle(in_angle)), blendMode(in_blendMode) {}
+	// Horizontal pass of the box blur on the alpha only, like blurU. The alpha of
+	// pixel i is alpha[i * stride], dst receives one value per pixel.
+	void blurAlphaU(unsigned char* dst, const unsigned char* alpha, const int stride, const Size& srcSize, const int size, const int yStart, const int yEnd) {
+		const int len = srcSize.width * srcSize.height;
+		const int sizeTotal = size * 2 + 1;
+		const int iStart = yStart * srcSize.width;
+		const int iEnd = yEnd * srcSize.width;
+		const int blurStart = dle::max(iStart, size);
+		const int blurEnd = dle::min(iEnd, len - size);
+
+		if (iStart < size) memset(dst + iStart, 0, dle::min(iEnd, size) - iStart);
+		if (len - size < iEnd) memset(dst + dle::max(iStart, len - size), 0, iEnd - dle::max(iStart, len - size));
+		if (blurStart >= blurEnd) return;
+
+		// Running sum of the window
+		int accum = 0;
+		const unsigned char* pLookup = alpha + (blurStart - size) * stride;
+		for (int i = 0; i < sizeTotal; ++i, pLookup += stride) {
+			accum += *pLookup;
+		}
+		const unsigned char* pOut = alpha + (blurStart - size) * stride;
+		const unsigned char* pIn = alpha + (blurStart + size + 1) * stride;
+		unsigned char* pDst = dst + blurStart;
+		unsigned char* pDstEnd = dst + blurEnd;
+		while (true) {
+			*pDst = accum / sizeTotal;
+			if (++pDst == pDstEnd) break;
+
+			accum += *pIn - *pOut;
+			pIn += stride; pOut += stride;
+		}
+	}
 
-	void Gradient::apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const {
-		if (!keys.size()) return;
+	// Vertical pass of the box blur on the alpha only, for rows [yStart, yEnd).
+	// src is the output of blurAlphaU. dst receives one value per pixel, starting
+	// at row yStart. Rows that are not blurred are transparent.
+	void blurAlphaV(unsigned char* dst, const unsigned char* src, const Size& srcSize, const int size, const int yStart, const int yEnd) {
+		const int w = srcSize.width;
+		const int sizeTotal = size * 2 + 1;
+		const int blurStart = dle::clamp(size, yStart, yEnd);
+		const int blurEnd = dle::clamp(srcSize.height - size, blurStart, yEnd);
+
+		memset(dst, 0, (blurStart - yStart) * w);
+		memset(dst + (blurEnd - yStart) * w, 0, (yEnd - blurEnd) * w);
+		if (blurStart >= blurEnd) return;
+
+		std::vector<int> accum(w, 0);
+		for (int y = blurStart - size; y <= blurStart + size; ++y) {
+			const unsigned char* pRow = src + y * w;
+			for (int x = 0; x < w; ++x) accum[x] += pRow[x];
+		}
+		for (int y = blurStart; y < blurEnd; ++y) {
+			unsigned char* pDst = dst + (y - yStart) * w;
+			for (int x = 0; x < w; ++x) pDst[x] = accum[x] / sizeTotal;
+			if (y + 1 == blurEnd) break;
+			const unsigned char* pIn = src + (y + size + 1) * w;
+			const unsigned char* pOut = src + (y - size) * w;
+			for (int x = 0; x < w; ++x) accum[x] += pIn[x] - pOut[x];
+		}
+	}
 
-		Color* pCur = src;
-		const Color* pEnd = src + srcSize.width * srcSize.height;
-		int x = 0;
-		int y = 0;
-		int percent, localPercent;
-		Color final;
+	// First two passes of the effects built on a blur of the alpha. The horizontal
+	// blur goes to the start of the scratch memory, followed by the full blur.
+	void alphaBlurRows(unsigned char* scratch, const unsigned char* alpha, const int stride, const Size& srcSize, const int size, const int pass, const int yStart, const int yEnd) {
+		if (pass == 0) dle::blurAlphaU(scratch, alpha, stride, srcSize, size, yStart, yEnd);
+		else dle::blurAlphaV(scratch + srcSize.width * (srcSize.height + yStart), scratch, srcSize, size, yStart, yEnd);
+	}
 
-		auto* pKey = &keys[0];
-		const auto* pKeyEnd = pKey + keys.size();
-		const int sintheta = g_sintable[angle] / 100;
-		const int costheta = g_sintable[(angle + 90) % 360] / 100;
-		const int size = abs(sintheta * srcSize.width) + abs(costheta * srcSize.height);
-		while (pCur != pEnd) {
-			while (x != srcSize.width) {
-				if (sintheta >= 0) {
-					if (costheta >= 0) {
-						percent = (x * sintheta + y * costheta) * 10000 / size;
-					}
-					else {
-						percent = (x * sintheta + (srcSize.height - y) * -costheta) * 10000 / size;
-					}
-				}
-				else {
-					if (costheta >= 0) {
-						percent = ((srcSize.width - x) * -sintheta + y * costheta) * 10000 / size;
-					}
-					else {
-						percent = ((srcSize.width - x) * -sintheta + (srcSize.height - y) * -costheta) * 10000 / size;
-					}
-				}
-				percent = dle::min(percent, 10000);
-				percent = dle::max(percent, 0);
-				localPercent = 0;
+	// Full blur of the alpha, left in the scratch memory by alphaBlurRows
+	inline const unsigned char* blurredAlpha(const Color* scratch, const Size& srcSize) {
+		return (const unsigned char*) scratch + srcSize.width * srcSize.height;
+	}
 
-				pKey = &keys[0];
-				while (pKey != pKeyEnd) {
-					if (percent < pKey->percent * 100) {
-						percent = (percent - localPercent * 100) * 10000 / (pKey->percent * 100 - localPercent * 100);
-						lerpPercentile(final, final, pKey->color, percent);
-						break;
-					}
-					final = pKey->color;
-					localPercent = pKey->percent;
-					++pKey;
-				}
+	inline int alphaBlurScratchSize(const Size& srcSize) {
+		// Two alpha planes, 4 pixels per color
+		return (srcSize.width * srcSize.height * 2 + 3) / 4;
+	}
 
-				final.a = pCur->a * final.a / 255;
-				blend(*dst, *dst, final, blendMode);
+	// Margin a box blur of size needs around the alpha, so it isn't cut by the
+	// image borders. The vertical pass leaves the first and last size rows
+	// unblurred, so the tail of the blur needs size more rows above and below.
+	// The horizontal pass runs across row ends, where the side margins leave it
+	// in transparent pixels
+	inline Extent blurExtent(const int size) {
+		Extent extent = { size, size * 2, size, size * 2 };
+		return extent;
+	}
 
-				++pCur; ++dst;
-				++x;
-			}
-			x = 0;
-			++y;
+	// Rows covered by an offset effect on the rows [yStart, yEnd). Offsets shift
+	// the flat image, so pixels move across row ends.
+	struct OffsetRange {
+		int dstStart;	// First pixel written
+		int dstEnd;		// Past the last pixel written
+		int shift;		// Source pixel = dst pixel - shift
+		int yStart;		// First source row read
+		int yEnd;		// Past the last source row read
+	};
+
+	OffsetRange offsetRange(const Offset& offset, const Size& srcSize, const int yStart, const int yEnd) {
+		const int len = srcSize.width * srcSize.height;
+		const int count = len - abs(offset.x) - abs(offset.y) * srcSize.width;
+		const int dstStart = dle::max(offset.x, 0) + dle::max(offset.y, 0) * srcSize.width;
+		const int srcStart = dle::max(-offset.x, 0) + dle::max(-offset.y, 0) * srcSize.width;
+		OffsetRange range;
+		range.shift = dstStart - srcStart;
+		range.dstStart = dle::max(yStart * srcSize.width, dstStart);
+		range.dstEnd = dle::min(yEnd * srcSize.width, dstStart + dle::max(count, 0));
+		range.yStart = range.yEnd = 0;
+		if (range.dstStart < range.dstEnd) {
+			range.yStart = (range.dstStart - range.shift) / srcSize.width;
+			range.yEnd = (range.dstEnd - 1 - range.shift) / srcSize.width + 1;
 		}
+		return range;
 	}
 
-	Layer::~Layer() {
-		for (auto* pEffect : effects) {
-			delete pEffect;
-		}
-	//	delete[] src;
+
+	ColorOverlay::ColorOverlay(const Color& in_color, const eBlendMode in_blendMode) :
+		color(in_color), blendMode(in_blendMode) {}
+
+	eEffectAccess Effect::getAccess() const {
+		return kEffectAccess_SeparateSource;
 	}
 
-	void Layer::bake(void* dst) const {
-		bake((Color*) dst);
+	eEffectAccess ColorOverlay::getAccess() const {
+		return kEffectAccess_InPlace;
 	}
 
-	void bakePS(Color* dst, Color* src, Color* end, const eBlendMode& blendMode) {
-		Color tmpOut;
-		while (dst != end) {
-			blend(*dst, *dst, *src, blendMode);
-			++dst; ++src;
+	Effect* ColorOverlay::scaled(const int factor) const {
+		return new ColorOverlay(*this);
+	}
+
+	Effect* ColorOverlay::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const ColorOverlay*>(&to) && "Keyframes must have the same effects");
+		const ColorOverlay& other = static_cast<const ColorOverlay&>(to);
+		return new ColorOverlay(dle::interpolate(color, other.color, t), blendMode);
+	}
+
+	void ColorOverlay::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		unsigned char alpha[BLEND_CHUNK_SIZE];
+		int count = (yEnd - yStart) * srcSize.width;
+		dst += yStart * srcSize.width;
+		src += yStart * srcSize.width;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) alpha[i] = src[i].a; // dst and src can be the same buffer
+			dle::blendRow(dst, src, &color, 0, chunk, blendMode);
+
+			for (int i = 0; i < chunk; ++i) dst[i].a = alpha[i]; // Mask overlay
+			dst += chunk; src += chunk; count -= chunk;
 		}
 	}
 
-	void Layer::bake(Color* dst) const {
-		int len = size.width * size.height;
-		Color* tmpImg = new Color[len * 2];
-		Color* tmpSrc = tmpImg + len;
 
-		// Copy our layer into temp buffer. We will apply the effects on top of it
-		memcpy(tmpImg, src, sizeof(Color) * len);
+	Blur::Blur(const int in_size) : size(in_size) {}
 
-		// Bake all effects
-		for (auto* pEffect : effects) {
-			memcpy(tmpSrc, tmpImg, sizeof(Color) * len);
-			pEffect->apply(dst, tmpImg, tmpSrc, size);
-		}
+	eEffectAccess Blur::getAccess() const {
+		return kEffectAccess_SeparateSource;
+	}
 
-		auto threadCount = std::thread::hardware_concurrency();
-		std::vector<std::future<void>> workers;
-		unsigned int i;
-		for (i = 0; i < threadCount - 1; ++i) {
-			workers.push_back(std::async(dle::bakePS, dst + len * i / threadCount, tmpImg + len * i / threadCount, dst + len * (i + 1) / threadCount, blendMode));
-		}
-		dle::bakePS(dst + len * i / threadCount, tmpImg + len * i / threadCount, dst + len * (i + 1) / threadCount, blendMode);
-		for (auto& worker : workers) worker.wait();
+	Effect* Blur::scaled(const int factor) const {
+		Blur* pEffect = new Blur(*this);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
 
-		delete[] tmpImg;
+	Effect* Blur::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const Blur*>(&to) && "Keyframes must have the same effects");
+		const Blur& other = static_cast<const Blur&>(to);
+		return new Blur(dle::interpolate(size, other.size, t));
 	}
 
+	int Blur::getPassCount() const {
+		return 2;
+	}
 
-	void applyLayers(void* dst, const Size& srcSize, const Layer& layer) {
-		assert(
-			layer.size.width == srcSize.width &&
-			layer.size.height == srcSize.height &&
-			"All layers must match the output dimensions");
+	Extent Blur::getExtent() const {
+		// The horizontal pass clears the ends of the image, which then lose the
+		// color transparent pixels keep. One more row keeps them out of the window
+		Extent extent = dle::blurExtent(size);
+		++extent.top;
+		++extent.bottom;
+		return extent;
+	}
 
-		layer.bake((Color*) dst);
+	int Blur::getScratchSize(const Size& srcSize) const {
+		return srcSize.width * srcSize.height;
+	}
+
+	void Blur::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (pass == 0) {
+			dle::blurU(scratch, src, srcSize, size, yStart, yEnd);
+			return;
+		}
+
+		dle::blurV(dst, scratch, srcSize, size, yStart, yEnd);
+
+		// Borders are not blurred, carry them over from the source
+		const int w = srcSize.width;
+		const int top = dle::min(yEnd, size);
+		const int bottom = dle::max(yStart, srcSize.height - size);
+		if (yStart < top) memcpy(dst + yStart * w, src + yStart * w, sizeof(Color) * (top - yStart) * w);
+		if (bottom < yEnd) memcpy(dst + bottom * w, src + bottom * w, sizeof(Color) * (yEnd - bottom) * w);
+	}
+
+
+	Outline::Outline(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
+		color(in_color), size(in_size), blendMode(in_blendMode) {}
+
+	eEffectAccess Outline::getAccess() const {
+		return kEffectAccess_BaseLayer;
+	}
+
+	Effect* Outline::scaled(const int factor) const {
+		Outline* pEffect = new Outline(*this);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
+
+	Effect* Outline::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const Outline*>(&to) && "Keyframes must have the same effects");
+		const Outline& other = static_cast<const Outline&>(to);
+		return new Outline(dle::interpolate(color, other.color, t), dle::interpolate(size, other.size, t), blendMode);
+	}
+
+	int Outline::getPassCount() const {
+		return 3;
+	}
+
+	Extent Outline::getExtent() const {
+		return dle::blurExtent(size);
+	}
+
+	int Outline::getScratchSize(const Size& srcSize) const {
+		return dle::alphaBlurScratchSize(srcSize);
+	}
+
+	int Outline::getAlphaBlurSize() const {
+		return size;
+	}
+
+	void Outline::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		applyAlphaRows(baseLayer, &src->a, sizeof(Color), scratch, srcSize, pass, yStart, yEnd);
+	}
+
+	void Outline::applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		// We create a blur first
+		if (pass < 2) {
+			dle::alphaBlurRows((unsigned char*) scratch, srcAlpha, alphaStride, srcSize, size, pass, yStart, yEnd);
+			return;
+		}
+
+		// Use the blur to create our outline
+		const unsigned char* pBlurPx = dle::blurredAlpha(scratch, srcSize) + yStart * srcSize.width;
+		Color finals[BLEND_CHUNK_SIZE];
+		int sizeP2 = 1;
+		while (sizeP2 < size) sizeP2 *= 2;
+		if (sizeP2 > 32) sizeP2 = 32;
+		int divider = 32 / sizeP2;
+		int multiplier = 8 * sizeP2;
+		int count = (yEnd - yStart) * srcSize.width;
+		baseLayer += yStart * srcSize.width;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) {
+				// Some magic to transform the blur into outline
+				int a = dle::clamp(pBlurPx[i], 0, divider);
+				a = dle::min(255, a * multiplier);
+				finals[i] = color;
+				finals[i].a = (a * color.a) / 255;
+			}
+			dle::blendRow(baseLayer, baseLayer, finals, 1, chunk, blendMode); // Blend direction to base layer.
+			pBlurPx += chunk; baseLayer += chunk; count -= chunk;
+		}
+	}
+
+
+	Shadow::Shadow(const Color& in_color, const Offset& in_offset, const int in_size, const eBlendMode in_blendMode) :
+		color(in_color), offset(in_offset), size(in_size), blendMode(in_blendMode) {}
+
+	eEffectAccess Shadow::getAccess() const {
+		return kEffectAccess_BaseLayer;
+	}
+
+	Effect* Shadow::scaled(const int factor) const {
+		Shadow* pEffect = new Shadow(*this);
+		pEffect->offset = dle::scaleOffset(offset, factor);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
+
+	Effect* Shadow::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const Shadow*>(&to) && "Keyframes must have the same effects");
+		const Shadow& other = static_cast<const Shadow&>(to);
+		return new Shadow(dle::interpolate(color, other.color, t), dle::interpolate(offset, other.offset, t), dle::interpolate(size, other.size, t), blendMode);
+	}
+
+	int Shadow::getPassCount() const {
+		return 3;
+	}
+
+	Extent Shadow::getExtent() const {
+		// The blur is whole around the alpha, and still in the image once offset
+		const Extent blur = dle::blurExtent(size);
+		Extent extent;
+		extent.left = dle::max(blur.left, size - offset.x);
+		extent.top = dle::max(blur.top, size - offset.y);
+		extent.right = dle::max(blur.right, size + offset.x);
+		extent.bottom = dle::max(blur.bottom, size + offset.y);
+		return extent;
+	}
+
+	int Shadow::getScratchSize(const Size& srcSize) const {
+		return dle::alphaBlurScratchSize(srcSize);
+	}
+
+	int Shadow::getAlphaBlurSize() const {
+		return size;
+	}
+
+	void Shadow::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		applyAlphaRows(baseLayer, &src->a, sizeof(Color), scratch, srcSize, pass, yStart, yEnd);
+	}
+
+	void Shadow::applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		// We create a blur first
+		if (pass < 2) {
+			dle::alphaBlurRows((unsigned char*) scratch, srcAlpha, alphaStride, srcSize, size, pass, yStart, yEnd);
+			return;
+		}
+		const OffsetRange range = dle::offsetRange(offset, srcSize, yStart, yEnd);
+		if (range.dstStart >= range.dstEnd) return;
+
+		// Use the blur to create our shadow, using the offset
+		const unsigned char* pBlurPx = dle::blurredAlpha(scratch, srcSize) + range.dstStart - range.shift;
+		Color finals[BLEND_CHUNK_SIZE];
+		int count = range.dstEnd - range.dstStart;
+		baseLayer += range.dstStart;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) {
+				finals[i] = color;
+				finals[i].a = (pBlurPx[i] * color.a) / 255;
+			}
+			dle::blendRow(baseLayer, baseLayer, finals, 1, chunk, blendMode); // Blend direction to base layer.
+			baseLayer += chunk; pBlurPx += chunk; count -= chunk;
+		}
+	}
+
+
+	InnerShadow::InnerShadow(const Color& in_color, const Offset& in_offset, const int in_size, const eBlendMode in_blendMode) :
+		color(in_color), offset(in_offset), size(in_size), blendMode(in_blendMode) {}
+
+	eEffectAccess InnerShadow::getAccess() const {
+		return kEffectAccess_InPlace;
+	}
+
+	Effect* InnerShadow::scaled(const int factor) const {
+		InnerShadow* pEffect = new InnerShadow(*this);
+		pEffect->offset = dle::scaleOffset(offset, factor);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
+
+	Effect* InnerShadow::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const InnerShadow*>(&to) && "Keyframes must have the same effects");
+		const InnerShadow& other = static_cast<const InnerShadow&>(to);
+		return new InnerShadow(dle::interpolate(color, other.color, t), dle::interpolate(offset, other.offset, t), dle::interpolate(size, other.size, t), blendMode);
+	}
+
+	int InnerShadow::getPassCount() const {
+		return 3;
+	}
+
+	int InnerShadow::getScratchSize(const Size& srcSize) const {
+		return dle::alphaBlurScratchSize(srcSize);
+	}
+
+	int InnerShadow::getAlphaBlurSize() const {
+		return size;
+	}
+
+	Extent InnerShadow::getExtent() const {
+		// Draws inside the alpha only, from the blur offset back. It must read
+		// blurred rows, from windows that stay in the image
+		Extent extent;
+		extent.left = dle::max(0, size + offset.x);
+		extent.top = dle::max(0, size + offset.y);
+		extent.right = dle::max(0, size - offset.x);
+		extent.bottom = dle::max(0, size - offset.y);
+		return extent;
+	}
+
+	void InnerShadow::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		// We create a blur first
+		if (pass < 2) {
+			dle::alphaBlurRows((unsigned char*) scratch, &src->a, sizeof(Color), srcSize, size, pass, yStart, yEnd);
+			return;
+		}
+		const OffsetRange range = dle::offsetRange(offset, srcSize, yStart, yEnd);
+		if (range.dstStart >= range.dstEnd) return;
+
+		// Use the blur to create our shadow, using the offset
+		const unsigned char* pBlurPx = dle::blurredAlpha(scratch, srcSize) + range.dstStart - range.shift;
+		Color finals[BLEND_CHUNK_SIZE];
+		int count = range.dstEnd - range.dstStart;
+		dst += range.dstStart;
+		src += range.dstStart;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) {
+				const int a = ((255 - pBlurPx[i]) * color.a) / 255;
+				finals[i] = color;
+				finals[i].a = a * src[i].a / 255;
+			}
+			dle::blendRow(dst, src, finals, 1, chunk, blendMode);
+			dst += chunk; src += chunk; pBlurPx += chunk; count -= chunk;
+		}
+	}
+
+
+	Glow::Glow(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
+		color(in_color), size(in_size), blendMode(in_blendMode) {}
+
+	eEffectAccess Glow::getAccess() const {
+		return kEffectAccess_BaseLayer;
+	}
+
+	Effect* Glow::scaled(const int factor) const {
+		Glow* pEffect = new Glow(*this);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
+
+	Effect* Glow::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const Glow*>(&to) && "Keyframes must have the same effects");
+		const Glow& other = static_cast<const Glow&>(to);
+		return new Glow(dle::interpolate(color, other.color, t), dle::interpolate(size, other.size, t), blendMode);
+	}
+
+	int Glow::getPassCount() const {
+		return 3;
+	}
+
+	Extent Glow::getExtent() const {
+		return dle::blurExtent(size);
+	}
+
+	int Glow::getScratchSize(const Size& srcSize) const {
+		return dle::alphaBlurScratchSize(srcSize);
+	}
+
+	int Glow::getAlphaBlurSize() const {
+		return size;
+	}
+
+	void Glow::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		applyAlphaRows(baseLayer, &src->a, sizeof(Color), scratch, srcSize, pass, yStart, yEnd);
+	}
+
+	void Glow::applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (pass < 2) {
+			dle::alphaBlurRows((unsigned char*) scratch, srcAlpha, alphaStride, srcSize, size, pass, yStart, yEnd);
+			return;
+		}
+
+		const unsigned char* pBlurPx = dle::blurredAlpha(scratch, srcSize) + yStart * srcSize.width;
+		Color finals[BLEND_CHUNK_SIZE];
+		int count = (yEnd - yStart) * srcSize.width;
+		baseLayer += yStart * srcSize.width;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) {
+				int a = dle::clamp(pBlurPx[i], 0, 128);
+				a = dle::min(255, a * 2);
+				finals[i] = color;
+				finals[i].a = a * color.a / 255;
+			}
+			dle::blendRow(baseLayer, baseLayer, finals, 1, chunk, blendMode);
+			baseLayer += chunk; pBlurPx += chunk; count -= chunk;
+		}
+	}
+
+
+	InnerGlow::InnerGlow(const Color& in_color, const int in_size, const eBlendMode in_blendMode) :
+		color(in_color), size(in_size), blendMode(in_blendMode) {}
+
+	eEffectAccess InnerGlow::getAccess() const {
+		return kEffectAccess_InPlace;
+	}
+
+	Effect* InnerGlow::scaled(const int factor) const {
+		InnerGlow* pEffect = new InnerGlow(*this);
+		pEffect->size = dle::scaleDistance(size, factor);
+		return pEffect;
+	}
+
+	Effect* InnerGlow::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const InnerGlow*>(&to) && "Keyframes must have the same effects");
+		const InnerGlow& other = static_cast<const InnerGlow&>(to);
+		return new InnerGlow(dle::interpolate(color, other.color, t), dle::interpolate(size, other.size, t), blendMode);
+	}
+
+	int InnerGlow::getPassCount() const {
+		return 3;
+	}
+
+	int InnerGlow::getScratchSize(const Size& srcSize) const {
+		return dle::alphaBlurScratchSize(srcSize);
+	}
+
+	int InnerGlow::getAlphaBlurSize() const {
+		return size;
+	}
+
+	Extent InnerGlow::getExtent() const {
+		// Draws inside the alpha only, from blurred rows
+		Extent extent = { size, size, size, size };
+		return extent;
+	}
+
+	void InnerGlow::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (pass < 2) {
+			dle::alphaBlurRows((unsigned char*) scratch, &src->a, sizeof(Color), srcSize, size, pass, yStart, yEnd);
+			return;
+		}
+
+		const unsigned char* pBlurPx = dle::blurredAlpha(scratch, srcSize) + yStart * srcSize.width;
+		Color finals[BLEND_CHUNK_SIZE];
+		int count = (yEnd - yStart) * srcSize.width;
+		dst += yStart * srcSize.width;
+		src += yStart * srcSize.width;
+		while (count > 0) {
+			const int chunk = dle::min(count, BLEND_CHUNK_SIZE);
+			for (int i = 0; i < chunk; ++i) {
+				int a = dle::clamp(pBlurPx[i], 127, 255) - 127;
+				a = 255 - dle::min(255, a * 2);
+				a = a * color.a / 255;
+				finals[i] = color;
+				finals[i].a = a * src[i].a / 255;
+			}
+			dle::blendRow(dst, dst, finals, 1, chunk, blendMode);
+			dst += chunk; src += chunk; pBlurPx += chunk; count -= chunk;
+		}
+	}
+
+
+	Gradient::Gradient(const std::vector<GradientKey>& in_keys, int in_angle, const eBlendMode in_blendMode) :
+		keys(in_keys), angle(wrapAngle(in_angle)), blendMode(in_blendMode) {}
+
+	eEffectAccess Gradient::getAccess() const {
+		return kEffectAccess_InPlace;
+	}
+
+	Effect* Gradient::scaled(const int factor) const {
+		return new Gradient(*this);
+	}
+
+	Effect* Gradient::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const Gradient*>(&to) && "Keyframes must have the same effects");
+		const Gradient& other = static_cast<const Gradient&>(to);
+		return new Gradient(dle::interpolate(keys, other.keys, t), dle::interpolateAngle(angle, other.angle, t), blendMode);
+	}
+
+	void Gradient::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (!keys.size()) return;
+
+		Color* pCur = src + yStart * srcSize.width;
+		const Color* pEnd = src + yEnd * srcSize.width;
+		int x = 0;
+		int y = yStart;
+		int percent, localPercent;
+		Color final;
+
+		auto* pKey = &keys[0];
+		const auto* pKeyEnd = pKey + keys.size();
+		const int sintheta = g_sintable[angle] / 100;
+		const int costheta = g_sintable[(angle + 90) % 360] / 100;
+		const int size = abs(sintheta * srcSize.width) + abs(costheta * srcSize.height);
+		dst += yStart * srcSize.width;
+		while (pCur != pEnd) {
+			while (x != srcSize.width) {
+				if (sintheta >= 0) {
+					if (costheta >= 0) {
+						percent = (x * sintheta + y * costheta) * 10000 / size;
+					}
+					else {
+						percent = (x * sintheta + (srcSize.height - y) * -costheta) * 10000 / size;
+					}
+				}
+				else {
+					if (costheta >= 0) {
+						percent = ((srcSize.width - x) * -sintheta + y * costheta) * 10000 / size;
+					}
+					else {
+						percent = ((srcSize.width - x) * -sintheta + (srcSize.height - y) * -costheta) * 10000 / size;
+					}
+				}
+				percent = dle::min(percent, 10000);
+				percent = dle::max(percent, 0);
+				localPercent = 0;
+
+				pKey = &keys[0];
+				final = pKey->color;
+				while (pKey != pKeyEnd) {
+					if (percent < pKey->percent * 100) {
+						percent = (percent - localPercent * 100) * 10000 / (pKey->percent * 100 - localPercent * 100);
+						lerpPercentile(final, final, pKey->color, percent);
+						break;
+					}
+					final = pKey->color;
+					localPercent = pKey->percent;
+					++pKey;
+				}
+
+				final.a = pCur->a * final.a / 255;
+				blend(*dst, *dst, final, blendMode);
+
+				++pCur; ++dst;
+				++x;
+			}
+			x = 0;
+			++y;
+		}
+	}
+
+	// The radial gradient looks up its colors from the squared distance to the
+	// center, so we never need a square root per pixel. The LUT is sized from the
+	// radius and the keys, so small and smooth gradients build a small one.
+	// Distances change fast with the first entries, the pixels that fall in them
+	// are evaluated exactly
+	static const int RADIAL_LUT_MIN_SIZE = 1 << 6;
+	static const int RADIAL_LUT_MAX_SIZE = 1 << 14;
+	static const int RADIAL_LUT_EXACT = 16;
+	static const int RADIAL_LUT_SHIFT = 32;
+
+	struct RadialShape {
+		int cx, cy;
+		int rx, ry;
+		int lutSize;
+	};
+
+	RadialShape radialShape(const RadialGradient& gradient, const Size& srcSize) {
+		RadialShape shape;
+		shape.cx = srcSize.width * gradient.center.x / 100;
+		shape.cy = srcSize.height * gradient.center.y / 100;
+		shape.rx = gradient.radius.width;
+		shape.ry = gradient.radius.height;
+		if (shape.rx <= 0) shape.rx = dle::max(shape.cx, srcSize.width - 1 - shape.cx);
+		if (shape.ry <= 0) shape.ry = dle::max(shape.cy, srcSize.height - 1 - shape.cy);
+		shape.rx = dle::max(shape.rx, 1);
+		shape.ry = dle::max(shape.ry, 1);
+
+		// One entry per squared pixel distance, so hard steps land on the right
+		// pixels, and enough entries for the colors to step by about 3 per channel.
+		// Entries get wider in distance toward the center, so steep keys close to it
+		// need more of them: at distance d, a LUT of n entries steps a key span by
+		// diff / span / (2 * d * n)
+		long long entries = (long long) dle::max(shape.rx, shape.ry) * dle::max(shape.rx, shape.ry);
+		for (size_t i = 1; i < gradient.keys.size(); ++i) {
+			const GradientKey& from = gradient.keys[i - 1];
+			const GradientKey& to = gradient.keys[i];
+			const int span = to.percent - from.percent;
+			if (span <= 0) continue;
+			const int diff = dle::max(dle::max(abs(to.color.r - from.color.r), abs(to.color.g - from.color.g)),
+				dle::max(abs(to.color.b - from.color.b), abs(to.color.a - from.color.a)));
+
+			// Distances under the exact ones are at least sqrt(RADIAL_LUT_EXACT / entries)
+			const long long k = (long long) diff * 100 / (6 * span);
+			long long needed = k * k / RADIAL_LUT_EXACT;
+			if (from.percent > 0) needed = std::min(needed, k * 100 / from.percent);
+			entries = std::max(entries, needed);
+		}
+		shape.lutSize = (int) std::min(std::max(entries + 1, (long long) RADIAL_LUT_MIN_SIZE), (long long) RADIAL_LUT_MAX_SIZE);
+		return shape;
+	}
+
+	void gradientKeyColor(Color& out, const std::vector<GradientKey>& keys, int percent) {
+		int localPercent = 0;
+		out = keys[0].color;
+		for (auto& key : keys) {
+			if (percent < key.percent * 100) {
+				percent = (percent - localPercent * 100) * 10000 / (key.percent * 100 - localPercent * 100);
+				lerpPercentile(out, out, key.color, percent);
+				return;
+			}
+			out = key.color;
+			localPercent = key.percent;
+		}
+	}
+
+	void radialGradientPS(Color* dst, const Color* src, int yStart, int yEnd, const Size& srcSize, const Color* lut, const int lutSize,
+		const std::vector<GradientKey>& keys, int cx, int cy, int rx, int ry, long long sx, long long sy, const eBlendMode blendMode) {
+		const Color outside = lut[lutSize - 1];
+		const int x0 = dle::max(0, cx - rx);
+		const int x1 = dle::min(srcSize.width, cx + rx + 1);
+		Color final;
+		dst += yStart * srcSize.width;
+		src += yStart * srcSize.width;
+		for (int y = yStart; y < yEnd; ++y) {
+			const int dy = y - cy;
+			int x = 0;
+			if (dy >= -ry && dy <= ry) {
+				// Pixels left of the ellipse
+				for (; x < x0; ++x, ++src, ++dst) {
+					final = outside;
+					final.a = src->a * final.a / 255;
+					blend(*dst, *dst, final, blendMode);
+				}
+
+				// Step the squared distance incrementally: q(dx + 1) = q(dx) + (2 * dx + 1) * sx
+				long long dx = x0 - cx;
+				long long q = dx * dx * sx + (long long) dy * dy * sy;
+				long long dq = (2 * dx + 1) * sx;
+				const long long ddq = 2 * sx;
+				for (; x < x1; ++x, ++src, ++dst) {
+					const int i = (int) (q >> RADIAL_LUT_SHIFT);
+					if (i < RADIAL_LUT_EXACT) {
+						const double d2 = (double) q / (double) (1ll << RADIAL_LUT_SHIFT) / (double) (lutSize - 1);
+						gradientKeyColor(final, keys, (int) (sqrt(d2) * 10000.0));
+					}
+					else {
+						final = lut[dle::min(i, lutSize - 1)];
+					}
+					final.a = src->a * final.a / 255;
+					blend(*dst, *dst, final, blendMode);
+					q += dq;
+					dq += ddq;
+				}
+			}
+
+			// Pixels right of the ellipse, or the whole row if it's above or under it
+			for (; x < srcSize.width; ++x, ++src, ++dst) {
+				final = outside;
+				final.a = src->a * final.a / 255;
+				blend(*dst, *dst, final, blendMode);
+			}
+		}
+	}
+
+	RadialGradient::RadialGradient(const std::vector<GradientKey>& in_keys, const Offset& in_center, const Size& in_radius, const eBlendMode in_blendMode) :
+		keys(in_keys), center(in_center), radius(in_radius), blendMode(in_blendMode) {}
+
+	eEffectAccess RadialGradient::getAccess() const {
+		return kEffectAccess_InPlace;
+	}
+
+	Effect* RadialGradient::scaled(const int factor) const {
+		RadialGradient* pEffect = new RadialGradient(*this);
+		pEffect->radius.width = dle::scaleDistance(radius.width, factor);
+		pEffect->radius.height = dle::scaleDistance(radius.height, factor);
+		return pEffect;
+	}
+
+	Effect* RadialGradient::interpolated(const Effect& to, const float t) const {
+		assert(dynamic_cast<const RadialGradient*>(&to) && "Keyframes must have the same effects");
+		const RadialGradient& other = static_cast<const RadialGradient&>(to);
+		return new RadialGradient(dle::interpolate(keys, other.keys, t), dle::interpolate(center, other.center, t), dle::interpolate(radius, other.radius, t), blendMode);
+	}
+
+	int RadialGradient::getPassCount() const {
+		return 2;
+	}
+
+	int RadialGradient::getScratchSize(const Size& srcSize) const {
+		return dle::radialShape(*this, srcSize).lutSize;
+	}
+
+	void RadialGradient::applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (!keys.size() || srcSize.height <= 0) return;
+
+		// First pass builds the LUT, indexed by the squared normalized distance. 0 is the center,
+		// lutSize - 1 is on the radius. Each range of rows builds its share of the entries
+		const RadialShape shape = dle::radialShape(*this, srcSize);
+		const int lutSize = shape.lutSize;
+		if (pass == 0) {
+			const int lutStart = (int) ((long long) lutSize * yStart / srcSize.height);
+			const int lutEnd = (int) ((long long) lutSize * yEnd / srcSize.height);
+			for (int i = lutStart; i < lutEnd; ++i) {
+				int percent = (int) (sqrt((double) i / (double) (lutSize - 1)) * 10000.0);
+				gradientKeyColor(scratch[i], keys, percent);
+			}
+			return;
+		}
+
+		// Fixed point scale from squared pixel distance to LUT index
+		const long long sx = ((long long) (lutSize - 1) << RADIAL_LUT_SHIFT) / ((long long) shape.rx * shape.rx);
+		const long long sy = ((long long) (lutSize - 1) << RADIAL_LUT_SHIFT) / ((long long) shape.ry * shape.ry);
+
+		dle::radialGradientPS(dst, src, yStart, yEnd, srcSize, scratch, lutSize, keys, shape.cx, shape.cy, shape.rx, shape.ry, sx, sy, blendMode);
+	}
+
+	Layer::~Layer() {
+		for (auto* pEffect : effects) {
+			delete pEffect;
+		}
+		delete[] src;
+	}
+
+	void Layer::bake(void* dst) const {
+		bake((Color*) dst);
+	}
+
+	void Layer::bake(Color* dst, const ePixelFormat dstFormat) const {
+		bake((void*) dst, dstFormat);
+	}
+
+	void Layer::bake(void* dst, const ePixelFormat dstFormat) const {
+		std::atomic<bool> cancelled(false);
+		bake(dst, dstFormat, cancelled);
+	}
+
+	// Expand pixels [start, end) of a source image to RGBA
+	void expandPS(Color* dst, const unsigned char* src, const ePixelFormat format, const Color& fill, const int start, const int end) {
+		switch (format) {
+		case kPixelFormat_RGBA:
+			memcpy(dst + start, src + start * sizeof(Color), sizeof(Color) * (end - start));
+			break;
+		case kPixelFormat_BGRA: {
+			const Color* pSrc = (const Color*) src + start;
+			for (int i = start; i < end; ++i, ++pSrc) {
+				dst[i].r = pSrc->b;
+				dst[i].g = pSrc->g;
+				dst[i].b = pSrc->r;
+				dst[i].a = pSrc->a;
+			}
+			break;
+		}
+		case kPixelFormat_A8:
+			for (int i = start; i < end; ++i) {
+				dst[i] = fill;
+				dst[i].a = src[i] * fill.a / 255;
+			}
+			break;
+		}
+	}
+
+	// Swap red and blue, turning RGBA into BGRA and back
+	void swizzlePS(Color* dst, Color* end) {
+		while (dst != end) {
+			std::swap(dst->r, dst->b);
+			++dst;
+		}
+	}
+
+	// Blend the layer on the underlying image base, into dst. base can be dst.
+	// swizzleIn reads base and swizzleOut writes dst as BGRA.
+	void bakePS(Color* dst, const Color* base, const Color* src, Color* end, const eBlendMode& blendMode, const bool swizzleIn, const bool swizzleOut) {
+		if (!swizzleIn && !swizzleOut) {
+			dle::blendRow(dst, base, src, 1, (int) (end - dst), blendMode);
+			return;
+		}
+		Color px[BLEND_CHUNK_SIZE];
+		while (dst != end) {
+			const int chunk = dle::min((int) (end - dst), BLEND_CHUNK_SIZE);
+			memcpy(px, base, sizeof(Color) * chunk);
+			if (swizzleIn) dle::swizzlePS(px, px + chunk);
+			dle::blendRow(px, px, src, 1, chunk, blendMode);
+			if (swizzleOut) dle::swizzlePS(px, px + chunk);
+			memcpy(dst, px, sizeof(Color) * chunk);
+			dst += chunk; base += chunk; src += chunk;
+		}
+	}
+
+	// Same as bakePS, for A8 layers that were never expanded
+	void bakeAlphaPS(Color* dst, const Color* base, const unsigned char* srcAlpha, const Color& fill, Color* end, const eBlendMode& blendMode, const bool swizzleIn, const bool swizzleOut) {
+		Color px[BLEND_CHUNK_SIZE];
+		Color srcPx[BLEND_CHUNK_SIZE];
+		while (dst != end) {
+			const int chunk = dle::min((int) (end - dst), BLEND_CHUNK_SIZE);
+			memcpy(px, base, sizeof(Color) * chunk);
+			if (swizzleIn) dle::swizzlePS(px, px + chunk);
+			for (int i = 0; i < chunk; ++i) {
+				srcPx[i] = fill;
+				srcPx[i].a = srcAlpha[i];
+			}
+			dle::blendRow(px, px, srcPx, 1, chunk, blendMode);
+			if (swizzleOut) dle::swizzlePS(px, px + chunk);
+			memcpy(dst, px, sizeof(Color) * chunk);
+			dst += chunk; base += chunk; srcAlpha += chunk;
+		}
+	}
+
+	// Alpha of an A8 layer with the fill alpha applied, the same as expandPS gives.
+	// Points straight to the source when the fill is opaque.
+	const unsigned char* layerAlpha(const Layer& layer, std::unique_ptr<unsigned char[]>& storage) {
+		const unsigned char* src = (const unsigned char*) layer.getSource();
+		if (layer.fill.a == 255) return src;
+		const int len = layer.size.width * layer.size.height;
+		storage.reset(new unsigned char[len]);
+		for (int i = 0; i < len; ++i) storage[i] = src[i] * layer.fill.a / 255;
+		return storage.get();
+	}
+
+	Layer::Layer(const Size& in_size, const ePixelFormat in_format, const Color& in_fill, const eBlendMode in_blendMode) :
+		size(in_size), blendMode(in_blendMode), fill(in_fill), format(in_format) {
+		const int bytes = size.width * size.height * (format == kPixelFormat_A8 ? 1 : (int) sizeof(Color));
+		src = new unsigned char[bytes];
+		memset(src, 0, bytes);
+	}
+
+	Extent Layer::getExtent() const {
+		// Effects drawing on the base layer grow from the layer as it is. Effects
+		// with a separate source grow the layer itself, the ones working in place
+		// only draw inside its alpha. Effects in place can still leave transparent
+		// pixels with other colors within their extent of the borders, like the
+		// rows InnerShadow doesn't reach. A blur reads those colors, so it grows
+		// from the layer padded by their extent
+		Extent extent = { 0, 0, 0, 0 };
+		Extent layerExtent = { 0, 0, 0, 0 };
+		Extent colorExtent = { 0, 0, 0, 0 };
+		for (auto* pEffect : effects) {
+			const eEffectAccess access = pEffect->getAccess();
+			const Extent effectExtent = pEffect->getExtent();
+			const Extent& from = access == kEffectAccess_SeparateSource ? colorExtent : layerExtent;
+			Extent grown;
+			grown.left = from.left + effectExtent.left;
+			grown.top = from.top + effectExtent.top;
+			grown.right = from.right + effectExtent.right;
+			grown.bottom = from.bottom + effectExtent.bottom;
+			if (access == kEffectAccess_SeparateSource) {
+				layerExtent = grown;
+				colorExtent = grown;
+			}
+			else if (access == kEffectAccess_InPlace) {
+				colorExtent.left = dle::max(colorExtent.left, grown.left);
+				colorExtent.top = dle::max(colorExtent.top, grown.top);
+				colorExtent.right = dle::max(colorExtent.right, grown.right);
+				colorExtent.bottom = dle::max(colorExtent.bottom, grown.bottom);
+			}
+			extent.left = dle::max(extent.left, grown.left);
+			extent.top = dle::max(extent.top, grown.top);
+			extent.right = dle::max(extent.right, grown.right);
+			extent.bottom = dle::max(extent.bottom, grown.bottom);
+		}
+		return extent;
+	}
+
+	void Layer::expandSource(Color* dst) const {
+		splitRows(0, size.height, [&](int yStart, int yEnd) {
+			dle::expandPS(dst, src, format, fill, yStart * size.width, yEnd * size.width);
+		});
+	}
+
+	void Layer::bake(Color* dst) const {
+		std::atomic<bool> cancelled(false);
+		bake(dst, cancelled);
+	}
+
+	bool Layer::bake(Color* dst, const std::atomic<bool>& cancelled) const {
+		return bake(dst, kPixelFormat_RGBA, cancelled);
+	}
+
+	bool Layer::bake(void* dst, const ePixelFormat dstFormat, const std::atomic<bool>& cancelled) const {
+		return bake(dst, dstFormat, size.width, cancelled);
+	}
+
+	void Layer::bake(void* dst, const ePixelFormat dstFormat, const int dstStride) const {
+		std::atomic<bool> cancelled(false);
+		bake(dst, dstFormat, dstStride, cancelled);
+	}
+
+	bool Layer::bake(void* in_dst, const ePixelFormat dstFormat, const int dstStride, const std::atomic<bool>& cancelled) const {
+		assert(dstFormat != kPixelFormat_A8 && "Layers bake to RGBA or BGRA");
+		Color* dst = (Color*) in_dst;
+		const int w = size.width;
+		const int len = size.width * size.height;
+		Color* tmpImg = NULL;
+		Color* tmpSrc = NULL;
+
+		// Effects get the base layer as a packed RGBA image. When dst is not one, it
+		// is copied, and the copy is blended on dst at the end
+		Color* base = dst;
+		std::unique_ptr<Color[]> baseCopy;
+		const bool swizzle = dstFormat == kPixelFormat_BGRA;
+		if (dstStride != w || swizzle) {
+			baseCopy.reset(new Color[len]);
+			base = baseCopy.get();
+			splitRows(0, size.height, [&](int yStart, int yEnd) {
+				for (int y = yStart; y < yEnd; ++y) {
+					memcpy(base + y * w, dst + y * dstStride, sizeof(Color) * w);
+					if (swizzle) dle::swizzlePS(base + y * w, base + (y + 1) * w);
+				}
+			});
+		}
+
+		// A8 layers stay alpha only until an effect needs their colors. The others
+		// are expanded into the temp buffer, we will apply the effects on top of it
+		std::unique_ptr<unsigned char[]> fillAlpha;
+		const unsigned char* alpha = NULL;
+		if (format == kPixelFormat_A8) {
+			alpha = dle::layerAlpha(*this, fillAlpha);
+		}
+		else {
+			tmpImg = new Color[len];
+			expandSource(tmpImg);
+		}
+
+		// Bake all effects. Effects needing a separate source write into the second
+		// buffer, then we swap them. The others work in place. Cancellation is
+		// checked between chunks of rows
+		for (auto* pEffect : effects) {
+			if (cancelled) break;
+			const eEffectAccess access = pEffect->getAccess();
+			if (!tmpImg) {
+				if (access == kEffectAccess_BaseLayer) {
+					dle::applyAlphaPasses(*pEffect, base, alpha, 1, size, cancelled);
+					continue;
+				}
+				tmpImg = new Color[len];
+				expandSource(tmpImg);
+			}
+			if (access == kEffectAccess_SeparateSource) {
+				if (!tmpSrc) tmpSrc = new Color[len];
+				dle::applyPasses(*pEffect, base, tmpSrc, tmpImg, size, cancelled);
+				std::swap(tmpImg, tmpSrc);
+			}
+			else {
+				dle::applyPasses(*pEffect, base, tmpImg, tmpImg, size, cancelled);
+			}
+		}
+
+		// The base is RGBA, only the result is swizzled back
+		const bool done = !cancelled && splitRowsCancellable(0, size.height, w, cancelled, [&](int yStart, int yEnd) {
+			for (int y = yStart; y < yEnd; ++y) {
+				Color* pDst = dst + y * dstStride;
+				const Color* pBase = base + y * w;
+				if (tmpImg) dle::bakePS(pDst, pBase, tmpImg + y * w, pDst + w, blendMode, false, swizzle);
+				else dle::bakeAlphaPS(pDst, pBase, alpha + y * w, fill, pDst + w, blendMode, false, swizzle);
+			}
+		});
+
+		delete[] tmpImg;
+		delete[] tmpSrc;
+		return done;
+	}
+
+	BakeJob::BakeJob(const Layer& in_layer, void* in_dst, const ePixelFormat in_dstFormat) :
+		layer(in_layer), dst((Color*) in_dst), scratchCapacity(0), effectIndex(0), pass(0), row(0), unitsDone(0), rowTime(0.f),
+		dstFormat(in_dstFormat), alpha(NULL), dstSwizzled(false), done(false) {
+		assert(dstFormat != kPixelFormat_A8 && "Layers bake to RGBA or BGRA");
+		if (layer.getFormat() == kPixelFormat_A8) {
+			alpha = dle::layerAlpha(layer, fillAlpha);
+		}
+		else {
+			img.reset(new Color[layer.size.width * layer.size.height]);
+			layer.expandSource(img.get());
+		}
+		unitCount = 1;
+		bool hasBaseLayer = false;
+		for (auto* pEffect : layer.getEffects()) {
+			unitCount += pEffect->getPassCount();
+			hasBaseLayer |= pEffect->getAccess() == kEffectAccess_BaseLayer;
+		}
+		if (hasBaseLayer && dstFormat == kPixelFormat_BGRA) ++unitCount;
+	}
+
+	bool BakeJob::step(const float milliseconds) {
+		if (done) return true;
+
+		const auto start = std::chrono::steady_clock::now();
+		const auto budget = std::chrono::duration<float, std::milli>(milliseconds);
+		const Size& size = layer.size;
+		const auto& effects = layer.getEffects();
+
+		// Work by chunks of rows, sized from the time the previous rows took to fit in the budget
+		const int maxChunkRows = dle::max(1, 32768 * (int) dle::getThreadCount() / dle::max(size.width, 1));
+		auto chunkStart = start;
+		while (true) {
+			// Rows cost differ between passes, start each pass with a small chunk to measure them
+			int chunkRows = dle::max(1, maxChunkRows / 8);
+			if (rowTime > 0.f) {
+				const float remaining = (budget - (chunkStart - start)).count();
+				chunkRows = dle::clamp((int) (remaining / rowTime), 1, maxChunkRows);
+			}
+			const int yStart = row;
+			const int yEnd = dle::min(row + chunkRows, size.height);
+
+			if (effectIndex < effects.size() && effects[effectIndex]->getAccess() == kEffectAccess_BaseLayer && dstFormat == kPixelFormat_BGRA && !dstSwizzled) {
+				// Base layer effects blend in RGBA
+				splitRows(yStart, yEnd, [&](int y0, int y1) {
+					dle::swizzlePS(dst + y0 * size.width, dst + y1 * size.width);
+				});
+
+				row = yEnd;
+				if (row == size.height) {
+					row = 0;
+					rowTime = 0.f;
+					++unitsDone;
+					dstSwizzled = true;
+				}
+			}
+			else if (effectIndex < effects.size()) {
+				const Effect* pEffect = effects[effectIndex];
+				const eEffectAccess access = pEffect->getAccess();
+				const bool separate = access == kEffectAccess_SeparateSource;
+				// Buffers are left uninitialized, so their pages are only touched by the effects
+				if (pass == 0 && row == 0) {
+					const int scratchSize = pEffect->getScratchSize(size);
+					if (scratchSize > scratchCapacity) {
+						scratch.reset(new Color[scratchSize]);
+						scratchCapacity = scratchSize;
+					}
+					if (separate && !imgSrc) imgSrc.reset(new Color[size.width * size.height]);
+					if (!img && access != kEffectAccess_BaseLayer) {
+						img.reset(new Color[size.width * size.height]);
+						layer.expandSource(img.get());
+					}
+				}
+
+				Color* pSrc = img.get();
+				Color* pDst = separate ? imgSrc.get() : pSrc;
+				Color* pScratch = scratch.get();
+				splitRows(yStart, yEnd, [&](int y0, int y1) {
+					if (pSrc) pEffect->applyRows(dst, pDst, pSrc, pScratch, size, pass, y0, y1);
+					else pEffect->applyAlphaRows(dst, alpha, 1, pScratch, size, pass, y0, y1);
+				});
+
+				row = yEnd;
+				if (row == size.height) {
+					row = 0;
+					rowTime = 0.f;
+					++unitsDone;
+					if (++pass == pEffect->getPassCount()) {
+						pass = 0;
+						if (separate) std::swap(img, imgSrc);
+						++effectIndex;
+					}
+				}
+			}
+			else {
+				// Blend the layer on the destination
+				const bool swizzleIn = dstFormat == kPixelFormat_BGRA && !dstSwizzled;
+				const bool swizzleOut = dstFormat == kPixelFormat_BGRA;
+				const Color* pImg = img.get();
+				splitRows(yStart, yEnd, [&](int y0, int y1) {
+					Color* pDst = dst + y0 * size.width;
+					Color* pEnd = dst + y1 * size.width;
+					if (pImg) dle::bakePS(pDst, pDst, pImg + y0 * size.width, pEnd, layer.blendMode, swizzleIn, swizzleOut);
+					else dle::bakeAlphaPS(pDst, pDst, alpha + y0 * size.width, layer.fill, pEnd, layer.blendMode, swizzleIn, swizzleOut);
+				});
+
+				row = yEnd;
+				if (row == size.height) {
+					++unitsDone;
+					done = true;
+					img.reset();
+					imgSrc.reset();
+					scratch.reset();
+					fillAlpha.reset();
+					return true;
+				}
+			}
+
+			const auto now = std::chrono::steady_clock::now();
+			if (row) rowTime = std::chrono::duration<float, std::milli>(now - chunkStart).count() / (float) (yEnd - yStart);
+			chunkStart = now;
+			if (now - start >= budget) return false;
+		}
+	}
+
+	bool BakeJob::isDone() const {
+		return done;
+	}
+
+	float BakeJob::getProgress() const {
+		if (done) return 1.f;
+		return ((float) unitsDone + (float) row / (float) dle::max(layer.size.height, 1)) / (float) unitCount;
+	}
+
+	Animation::Animation(const Layer& in_layer) : layer(in_layer) {
+		Keyframe first;
+		first.frame = 0;
+		first.effects = layer.getEffects();
+		keyframes.push_back(first);
+	}
+
+	Animation::~Animation() {
+		for (size_t k = 1; k < keyframes.size(); ++k) {
+			for (auto* pEffect : keyframes[k].effects) {
+				delete pEffect;
+			}
+		}
+	}
+
+	void Animation::addKeyframe(const int frame, const std::vector<Effect*>& effects) {
+		assert(frame > 0 && "Frame 0 is the layer");
+		assert(effects.size() == layer.getEffects().size() && "Keyframes must have the same effects");
+
+		size_t k = 1;
+		while (k < keyframes.size() && keyframes[k].frame < frame) ++k;
+		if (k < keyframes.size() && keyframes[k].frame == frame) {
+			for (auto* pEffect : keyframes[k].effects) {
+				delete pEffect;
+			}
+			keyframes[k].effects = effects;
+			return;
+		}
+		Keyframe keyframe;
+		keyframe.frame = frame;
+		keyframe.effects = effects;
+		keyframes.insert(keyframes.begin() + k, keyframe);
+	}
+
+	std::vector<Effect*> Animation::createEffects(const int frame) const {
+		size_t k = 0;
+		while (k + 1 < keyframes.size() && keyframes[k + 1].frame <= frame) ++k;
+		const Keyframe& from = keyframes[k];
+		const Keyframe& to = keyframes[dle::min((int) k + 1, (int) keyframes.size() - 1)];
+		float t = 0.f;
+		if (to.frame > from.frame) {
+			t = (float) dle::clamp(frame - from.frame, 0, to.frame - from.frame) / (float) (to.frame - from.frame);
+		}
+
+		std::vector<Effect*> effects;
+		for (size_t i = 0; i < from.effects.size(); ++i) {
+			effects.push_back(from.effects[i]->interpolated(*to.effects[i], t));
+		}
+		return effects;
+	}
+
+	Layer* Animation::createFrame(const int frame) const {
+		Layer* pLayer = new Layer(layer.getSource(), layer.size, layer.getFormat(), layer.fill, layer.blendMode);
+		pLayer->effects = createEffects(frame);
+		return pLayer;
+	}
+
+	// Run fn on the rows [0, height), across threads if split is set
+	template<typename Fn> void forRows(const bool split, const int height, Fn fn) {
+		if (split) splitRows(0, height, fn);
+		else fn(0, height);
+	}
+
+	void Animation::bake(void* in_dst, const int frameCount, const ePixelFormat dstFormat) const {
+		assert(dstFormat != kPixelFormat_A8 && "Layers bake to RGBA or BGRA");
+		const Size& size = layer.size;
+		const int len = size.width * size.height;
+		if (frameCount <= 0 || len <= 0) return;
+		Color* dst = (Color*) in_dst;
+
+		std::vector<std::vector<Effect*>> frames(frameCount);
+		for (int f = 0; f < frameCount; ++f) {
+			frames[f] = createEffects(f);
+		}
+
+		// Expand the source once. A8 layers read their alpha directly, as long as
+		// only base layer effects run
+		bool needsSource = layer.getFormat() != kPixelFormat_A8;
+		for (auto* pEffect : layer.getEffects()) {
+			needsSource |= pEffect->getAccess() != kEffectAccess_BaseLayer;
+		}
+		std::vector<Color> source;
+		if (needsSource) {
+			source.resize(len);
+			layer.expandSource(source.data());
+		}
+		std::unique_ptr<unsigned char[]> fillAlpha;
+		const unsigned char* alpha = needsSource ? &source[0].a : dle::layerAlpha(layer, fillAlpha);
+		const int alphaStride = needsSource ? sizeof(Color) : 1;
+
+		// Alpha blurs of the effects that see the source unchanged, once per size.
+		// The frames only read them
+		std::vector<int> blurSizes;
+		std::vector<std::vector<Color>> blurs;
+		for (auto& effects : frames) {
+			for (auto* pEffect : effects) {
+				const int blurSize = pEffect->getAlphaBlurSize();
+				if (blurSize >= 0 && std::find(blurSizes.begin(), blurSizes.end(), blurSize) == blurSizes.end()) {
+					blurSizes.push_back(blurSize);
+					blurs.push_back(std::vector<Color>(pEffect->getScratchSize(size)));
+					Color* pBlur = blurs.back().data();
+					for (int pass = 0; pass < 2; ++pass) {
+						splitRows(0, size.height, [&](int yStart, int yEnd) {
+							if (pEffect->getAccess() == kEffectAccess_BaseLayer) pEffect->applyAlphaRows(NULL, alpha, alphaStride, pBlur, size, pass, yStart, yEnd);
+							else pEffect->applyRows(NULL, source.data(), source.data(), pBlur, size, pass, yStart, yEnd);
+						});
+					}
+				}
+				if (pEffect->getAccess() != kEffectAccess_BaseLayer) break;
+			}
+		}
+
+		// Frames bake in parallel. With fewer frames than threads, their rows are split instead
+		const bool splitFrames = frameCount >= (int) dle::getThreadCount();
+		std::atomic<int> nextFrame(0);
+		auto bakeFrames = [&]() {
+			// Buffers are reused by all the frames of a worker
+			std::vector<Color> img, imgSrc, scratch;
+			int f;
+			while ((f = nextFrame++) < frameCount) {
+				Color* frameDst = dst + (size_t) f * len;
+				bool dstSwizzled = false;
+				bool unchanged = true;	// The layer is still the source
+				for (auto* pEffect : frames[f]) {
+					const eEffectAccess access = pEffect->getAccess();
+					if (access == kEffectAccess_BaseLayer && dstFormat == kPixelFormat_BGRA && !dstSwizzled) {
+						// Base layer effects blend in RGBA
+						forRows(!splitFrames, size.height, [&](int yStart, int yEnd) {
+							dle::swizzlePS(frameDst + yStart * size.width, frameDst + yEnd * size.width);
+						});
+						dstSwizzled = true;
+					}
+
+					// The alpha blur of the source is already done
+					int firstPass = 0;
+					Color* pScratch;
+					const int blurSize = unchanged ? pEffect->getAlphaBlurSize() : -1;
+					if (blurSize >= 0) {
+						pScratch = blurs[std::find(blurSizes.begin(), blurSizes.end(), blurSize) - blurSizes.begin()].data();
+						firstPass = 2;
+					}
+					else {
+						if ((int) scratch.size() < pEffect->getScratchSize(size)) scratch.resize(pEffect->getScratchSize(size));
+						pScratch = scratch.data();
+					}
+
+					const int passCount = pEffect->getPassCount();
+					if (unchanged && access == kEffectAccess_BaseLayer) {
+						for (int pass = firstPass; pass < passCount; ++pass) {
+							forRows(!splitFrames, size.height, [&](int yStart, int yEnd) {
+								pEffect->applyAlphaRows(frameDst, alpha, alphaStride, pScratch, size, pass, yStart, yEnd);
+							});
+						}
+						continue;
+					}
+
+					if (unchanged) {
+						img.assign(source.begin(), source.end());
+						unchanged = false;
+					}
+					Color* pSrc = img.data();
+					Color* pDst = pSrc;
+					if (access == kEffectAccess_SeparateSource) {
+						imgSrc.resize(len);
+						pDst = imgSrc.data();
+					}
+					for (int pass = firstPass; pass < passCount; ++pass) {
+						forRows(!splitFrames, size.height, [&](int yStart, int yEnd) {
+							pEffect->applyRows(frameDst, pDst, pSrc, pScratch, size, pass, yStart, yEnd);
+						});
+					}
+					if (access == kEffectAccess_SeparateSource) img.swap(imgSrc);
+				}
+
+				// Blend the layer on the destination
+				const bool swizzleIn = dstFormat == kPixelFormat_BGRA && !dstSwizzled;
+				const bool swizzleOut = dstFormat == kPixelFormat_BGRA;
+				forRows(!splitFrames, size.height, [&](int yStart, int yEnd) {
+					Color* pDst = frameDst + yStart * size.width;
+					Color* pEnd = frameDst + yEnd * size.width;
+					if (!unchanged) dle::bakePS(pDst, pDst, img.data() + yStart * size.width, pEnd, layer.blendMode, swizzleIn, swizzleOut);
+					else if (needsSource) dle::bakePS(pDst, pDst, source.data() + yStart * size.width, pEnd, layer.blendMode, swizzleIn, swizzleOut);
+					else dle::bakeAlphaPS(pDst, pDst, alpha + yStart * size.width, layer.fill, pEnd, layer.blendMode, swizzleIn, swizzleOut);
+				});
+			}
+		};
+
+		std::vector<std::future<void>> workers;
+		if (splitFrames) {
+			for (unsigned int i = 0; i < dle::getThreadCount() - 1; ++i) {
+				workers.push_back(std::async(std::launch::async, bakeFrames));
+			}
+		}
+		bakeFrames();
+		for (auto& worker : workers) worker.wait();
+
+		for (auto& effects : frames) {
+			for (auto* pEffect : effects) {
+				delete pEffect;
+			}
+		}
+	}
+
+	Atlas::Atlas(const Size& in_size, const int in_padding) : size(in_size), padding(in_padding) {
+	}
+
+	int Atlas::add(const Layer& layer) {
+		Sprite sprite;
+		sprite.layer = &layer;
+		sprite.extent = layer.getExtent();
+		sprite.slot.x = 0;
+		sprite.slot.y = 0;
+		sprite.slot.width = layer.size.width + sprite.extent.left + sprite.extent.right;
+		sprite.slot.height = layer.size.height + sprite.extent.top + sprite.extent.bottom;
+		sprites.push_back(sprite);
+		return (int) sprites.size() - 1;
+	}
+
+	bool Atlas::pack() {
+		std::vector<int> order(sprites.size());
+		for (int i = 0; i < (int) order.size(); ++i) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+			return sprites[a].slot.height > sprites[b].slot.height;
+		});
+
+		// Fill rows left to right. A row is as tall as its first sprite
+		bool fits = true;
+		int x = 0, y = 0, rowHeight = 0;
+		for (auto i : order) {
+			Rect& slot = sprites[i].slot;
+			if (x > 0 && x + slot.width > size.width) {
+				x = 0;
+				y += rowHeight + padding;
+				rowHeight = 0;
+			}
+			if (x + slot.width > size.width || y + slot.height > size.height) {
+				slot.x = 0;
+				slot.y = 0;
+				slot.width = 0;
+				slot.height = 0;
+				fits = false;
+				continue;
+			}
+			slot.x = x;
+			slot.y = y;
+			x += slot.width + padding;
+			rowHeight = dle::max(rowHeight, slot.height);
+		}
+		return fits;
+	}
+
+	Rect Atlas::getSlot(const int index) const {
+		return sprites[index].slot;
+	}
+
+	Offset Atlas::getOrigin(const int index) const {
+		const Sprite& sprite = sprites[index];
+		Offset origin = { sprite.slot.x + sprite.extent.left, sprite.slot.y + sprite.extent.top };
+		return origin;
+	}
+
+	void Atlas::bake(void* in_dst, const ePixelFormat dstFormat) const {
+		Color* dst = (Color*) in_dst;
+		for (auto& sprite : sprites) {
+			if (!sprite.slot.width || !sprite.slot.height) continue;
+			const Layer& layer = *sprite.layer;
+			const Size slotSize = { sprite.slot.width, sprite.slot.height };
+
+			// Pad the source to the slot, the effects grow into the padding
+			Layer padded(slotSize, layer.format, layer.fill, layer.blendMode);
+			const int bpp = layer.format == kPixelFormat_A8 ? 1 : (int) sizeof(Color);
+			for (int y = 0; y < layer.size.height; ++y) {
+				memcpy(padded.src + ((y + sprite.extent.top) * slotSize.width + sprite.extent.left) * bpp,
+					layer.src + y * layer.size.width * bpp, layer.size.width * bpp);
+			}
+
+			// Borrow the effects of the layer
+			padded.effects = layer.effects;
+			padded.bake(dst + sprite.slot.y * size.width + sprite.slot.x, dstFormat, size.width);
+			padded.effects.clear();
+		}
+	}
+
+	Size previewSize(const Size& srcSize, const int factor) {
+		Size size;
+		size.width = (srcSize.width + factor - 1) / factor;
+		size.height = (srcSize.height + factor - 1) / factor;
+		return size;
+	}
+
+	void downscale(void* in_dst, const void* in_src, const Size& srcSize, const int factor) {
+		Color* dst = (Color*) in_dst;
+		const Color* src = (const Color*) in_src;
+		const Size size = previewSize(srcSize, factor);
+		splitRows(0, size.height, [&](int yStart, int yEnd) {
+			int accum[4];
+			for (int y = yStart; y < yEnd; ++y) {
+				const int syEnd = dle::min((y + 1) * factor, srcSize.height);
+				for (int x = 0; x < size.width; ++x) {
+					const int sxEnd = dle::min((x + 1) * factor, srcSize.width);
+					accum[0] = accum[1] = accum[2] = accum[3] = 0;
+					for (int sy = y * factor; sy < syEnd; ++sy) {
+						const Color* pPx = src + sy * srcSize.width + x * factor;
+						for (int sx = x * factor; sx < sxEnd; ++sx, ++pPx) {
+							accum[0] += pPx->r;
+							accum[1] += pPx->g;
+							accum[2] += pPx->b;
+							accum[3] += pPx->a;
+						}
+					}
+					const int count = (syEnd - y * factor) * (sxEnd - x * factor);
+					Color& out = dst[y * size.width + x];
+					out.r = accum[0] / count;
+					out.g = accum[1] / count;
+					out.b = accum[2] / count;
+					out.a = accum[3] / count;
+				}
+			}
+		});
+	}
+
+	void Layer::bakePreview(void* dst, const int factor, const ePixelFormat dstFormat) const {
+		if (factor <= 1) {
+			bake(dst, dstFormat);
+			return;
+		}
+
+		std::vector<Color> expanded;
+		const void* pSrc = src;
+		if (format != kPixelFormat_RGBA) {
+			expanded.resize(size.width * size.height);
+			expandSource(expanded.data());
+			pSrc = expanded.data();
+		}
+		const Size smallSize = previewSize(size, factor);
+		std::vector<Color> smallSrc(smallSize.width * smallSize.height);
+		downscale(smallSrc.data(), pSrc, size, factor);
+
+		Layer preview(smallSrc.data(), smallSize, blendMode);
+		for (auto* pEffect : effects) {
+			preview.effects.push_back(pEffect->scaled(factor));
+		}
+		preview.bake(dst, dstFormat);
+	}
+
+	BakeHandle Layer::bakeProgressive(void* previewDst, const int factor, void* dst, const int priority, const ePixelFormat dstFormat) const {
+		bakePreview(previewDst, factor, dstFormat);
+		return bakeAsync(dst, dstFormat, priority);
+	}
+
+	// Background baking. A single scheduler thread runs the jobs one at a time, by
+	// priority then submission order. Each bake still splits its effects across threads.
+	struct AsyncBakeJob {
+		const Layer*			layer;
+		Color*					dst;
+		ePixelFormat			dstFormat;
+		int						priority;
+		unsigned long long		order;
+		std::atomic<int>		status;
+		std::atomic<bool>		cancelled;
+		std::promise<bool>		promise;
+		std::shared_future<bool> future;
+	};
+
+	class BakeScheduler {
+	public:
+		static BakeScheduler& get() {
+			static BakeScheduler instance;
+			return instance;
+		}
+
+		void push(const std::shared_ptr<AsyncBakeJob>& job) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!thread.joinable()) thread = std::thread(&BakeScheduler::run, this);
+			job->order = order++;
+			queue.push(job);
+			condition.notify_one();
+		}
+
+		~BakeScheduler() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+				condition.notify_one();
+			}
+			if (thread.joinable()) thread.join();
+
+			// Resolve what never got to run
+			while (!queue.empty()) {
+				int expected = kBakeStatus_Pending;
+				if (queue.top()->status.compare_exchange_strong(expected, kBakeStatus_Cancelled)) {
+					queue.top()->promise.set_value(false);
+				}
+				queue.pop();
+			}
+		}
+
+	private:
+		BakeScheduler() : stopping(false), order(0) {}
+
+		void run() {
+			while (true) {
+				std::shared_ptr<AsyncBakeJob> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					condition.wait(lock, [this] { return stopping || !queue.empty(); });
+					if (stopping) return;
+					job = queue.top();
+					queue.pop();
+				}
+
+				// Cancelled while pending, it's already resolved
+				int expected = kBakeStatus_Pending;
+				if (!job->status.compare_exchange_strong(expected, kBakeStatus_Running)) continue;
+
+				const bool done = job->layer->bake(job->dst, job->dstFormat, job->cancelled);
+				job->status = done ? kBakeStatus_Done : kBakeStatus_Cancelled;
+				job->promise.set_value(done);
+			}
+		}
+
+		struct Compare {
+			bool operator()(const std::shared_ptr<AsyncBakeJob>& a, const std::shared_ptr<AsyncBakeJob>& b) const {
+				if (a->priority != b->priority) return a->priority < b->priority;
+				return a->order > b->order;
+			}
+		};
+
+		std::priority_queue<std::shared_ptr<AsyncBakeJob>, std::vector<std::shared_ptr<AsyncBakeJob>>, Compare> queue;
+		std::mutex				mutex;
+		std::condition_variable	condition;
+		std::thread				thread;
+		bool					stopping;
+		unsigned long long		order;
+	};
+
+	BakeHandle::BakeHandle(const std::shared_ptr<AsyncBakeJob>& in_job) : job(in_job) {}
+
+	eBakeStatus BakeHandle::getStatus() const {
+		return (eBakeStatus) job->status.load();
+	}
+
+	void BakeHandle::cancel() {
+		job->cancelled = true;
+		int expected = kBakeStatus_Pending;
+		if (job->status.compare_exchange_strong(expected, kBakeStatus_Cancelled)) {
+			job->promise.set_value(false);
+		}
+	}
+
+	bool BakeHandle::wait() const {
+		return job->future.get();
+	}
+
+	std::shared_future<bool> BakeHandle::getFuture() const {
+		return job->future;
+	}
+
+	BakeHandle Layer::bakeAsync(Color* dst, const int priority) const {
+		return bakeAsync(dst, kPixelFormat_RGBA, priority);
+	}
+
+	BakeHandle Layer::bakeAsync(void* dst, const ePixelFormat dstFormat, const int priority) const {
+		auto job = std::make_shared<AsyncBakeJob>();
+		job->layer = this;
+		job->dst = (Color*) dst;
+		job->dstFormat = dstFormat;
+		job->priority = priority;
+		job->status = kBakeStatus_Pending;
+		job->cancelled = false;
+		job->future = job->promise.get_future().share();
+		BakeScheduler::get().push(job);
+		return BakeHandle(job);
+	}
+
+	BakeHandle Layer::bakeAsync(void* dst, const int priority) const {
+		return bakeAsync((Color*) dst, priority);
+	}
+
+
+	void applyLayers(void* dst, const Size& srcSize, const Layer& layer) {
+		assert(
+			layer.size.width == srcSize.width &&
+			layer.size.height == srcSize.height &&
+			"All layers must match the output dimensions");
+
+		layer.bake((Color*) dst);
+	}
+
+
+
+	// Squared euclidean distance transform in 1D, from Felzenszwalb & Huttenlocher.
+	// f is the input cost of each sample, d receives the squared distances. The
+	// feature of the nearest sample is carried from featureIn to featureOut.
+	static const float DT_INF = 1e20f;
+
+	void distanceTransform1D(const float* f, float* d, const int* featureIn, int* featureOut, int n, int* v, float* z) {
+		int k = 0;
+		v[0] = 0;
+		z[0] = -DT_INF;
+		z[1] = DT_INF;
+		for (int q = 1; q < n; ++q) {
+			float s = ((f[q] + (float) (q * q)) - (f[v[k]] + (float) (v[k] * v[k]))) / (float) (2 * q - 2 * v[k]);
+			while (s <= z[k]) {
+				--k;
+				s = ((f[q] + (float) (q * q)) - (f[v[k]] + (float) (v[k] * v[k]))) / (float) (2 * q - 2 * v[k]);
+			}
+			++k;
+			v[k] = q;
+			z[k] = s;
+			z[k + 1] = DT_INF;
+		}
+		k = 0;
+		for (int q = 0; q < n; ++q) {
+			while (z[k + 1] < (float) q) ++k;
+			d[q] = (float) ((q - v[k]) * (q - v[k])) + f[v[k]];
+			featureOut[q] = featureIn[v[k]];
+		}
+	}
+
+	// The features start as the index of each seed pixel, and end up as the index of
+	// the nearest seed
+	void distanceTransform2D(float* grid, int* features, const Size& size) {
+		const int n = dle::max(size.width, size.height);
+		std::vector<float> f(n), d(n), z(n + 1);
+		std::vector<int> v(n), featureIn(n), featureOut(n);
+
+		// Columns
+		for (int x = 0; x < size.width; ++x) {
+			for (int y = 0; y < size.height; ++y) {
+				f[y] = grid[y * size.width + x];
+				featureIn[y] = features[y * size.width + x];
+			}
+			distanceTransform1D(f.data(), d.data(), featureIn.data(), featureOut.data(), size.height, v.data(), z.data());
+			for (int y = 0; y < size.height; ++y) {
+				grid[y * size.width + x] = d[y];
+				features[y * size.width + x] = featureOut[y];
+			}
+		}
+
+		// Rows
+		for (int y = 0; y < size.height; ++y) {
+			float* pRow = grid + y * size.width;
+			int* pFeatures = features + y * size.width;
+			memcpy(f.data(), pRow, sizeof(float) * size.width);
+			memcpy(featureIn.data(), pFeatures, sizeof(int) * size.width);
+			distanceTransform1D(f.data(), pRow, featureIn.data(), pFeatures, size.width, v.data(), z.data());
+		}
+	}
+
+	// Sobel gradient of an alpha plane at a pixel, clamped at the borders
+	void alphaGradient(const unsigned char* alpha, const int stride, const Size& size, const int x, const int y, float& gx, float& gy) {
+		const int x0 = dle::max(x - 1, 0), x1 = dle::min(x + 1, size.width - 1);
+		const int y0 = dle::max(y - 1, 0), y1 = dle::min(y + 1, size.height - 1);
+		auto at = [&](int ax, int ay) { return (int) alpha[(ay * size.width + ax) * stride]; };
+		gx = (float) (at(x1, y0) + 2 * at(x1, y) + at(x1, y1) - at(x0, y0) - 2 * at(x0, y) - at(x0, y1));
+		gy = (float) (at(x0, y1) + 2 * at(x, y1) + at(x1, y1) - at(x0, y0) - 2 * at(x, y0) - at(x1, y0));
+	}
+
+	// Distance from the center of a pixel to a straight edge crossing it, from the
+	// coverage of the pixel and the direction of the edge normal, of any length.
+	// Positive when the center is outside. From Gustavson's anti-aliased euclidean
+	// distance transform.
+	float edgeDistance(float nx, float ny, const int alpha) {
+		const float a = (float) alpha / 255.f;
+		const float length = sqrtf(nx * nx + ny * ny);
+		if (length == 0.f) return .5f - a;
+		nx = fabsf(nx) / length;
+		ny = fabsf(ny) / length;
+		if (nx < ny) std::swap(nx, ny);
+		if (ny < 1e-4f) return .5f - a;
+		const float a1 = .5f * ny / nx;
+		if (a < a1) return .5f * (nx + ny) - sqrtf(2.f * nx * ny * a);
+		if (a < 1.f - a1) return (.5f - a) * nx;
+		return -.5f * (nx + ny) + sqrtf(2.f * nx * ny * (1.f - a));
+	}
+
+	// Distance field of an alpha plane. The alpha of pixel i is alpha[i * stride]
+	DistanceField bakeAlphaDistanceField(const unsigned char* alpha, const int stride, const Size& srcSize, const int spread, const int downsample) {
+		const int len = srcSize.width * srcSize.height;
+		const int ds = dle::max(downsample, 1);
+
+		DistanceField field;
+		field.size.width = (srcSize.width + ds - 1) / ds;
+		field.size.height = (srcSize.height + ds - 1) / ds;
+		field.spread = dle::max(spread, 1);
+		field.downsample = ds;
+		field.data.resize(field.size.width * field.size.height);
+
+		// Distance to the nearest pixel the edge can cross from the inside and from
+		// the outside, with the index of that pixel. Partially covered pixels hold
+		// the edge, and seed both sides
+		std::vector<float> toInside(len), toOutside(len);
+		std::vector<int> nearestInside(len), nearestOutside(len);
+		for (int i = 0; i < len; ++i) {
+			const int a = alpha[i * stride];
+			toInside[i] = a > 0 ? 0.f : DT_INF;
+			toOutside[i] = a < 255 ? 0.f : DT_INF;
+			nearestInside[i] = a > 0 ? i : -1;
+			nearestOutside[i] = a < 255 ? i : -1;
+		}
+		distanceTransform2D(toInside.data(), nearestInside.data(), srcSize);
+		distanceTransform2D(toOutside.data(), nearestOutside.data(), srcSize);
+
+		// Sample the center of each downsampled block. The edge crosses each seed
+		// where its coverage places it, along the alpha gradient. The nearest seed
+		// isn't always the nearest edge, so its neighbours are tried as well.
+		unsigned char* pDst = field.data.data();
+		for (int y = 0; y < field.size.height; ++y) {
+			const int sy = dle::min(y * ds + ds / 2, srcSize.height - 1);
+			for (int x = 0; x < field.size.width; ++x, ++pDst) {
+				const int sx = dle::min(x * ds + ds / 2, srcSize.width - 1);
+				const int i = sy * srcSize.width + sx;
+				const bool inside = alpha[i * stride] >= 128;
+				const int q = inside ? nearestOutside[i] : nearestInside[i];
+				float dist = (float) field.spread;
+				if (q >= 0) {
+					const int qx = q % srcSize.width;
+					const int qy = q / srcSize.width;
+					for (int cy = dle::max(qy - 1, 0); cy <= dle::min(qy + 1, srcSize.height - 1); ++cy) {
+						for (int cx = dle::max(qx - 1, 0); cx <= dle::min(qx + 1, srcSize.width - 1); ++cx) {
+							const int a = alpha[(cy * srcSize.width + cx) * stride];
+							if (inside ? a == 255 : a == 0) continue;
+							float gx, gy;
+							alphaGradient(alpha, stride, srcSize, cx, cy, gx, gy);
+							const float d = sqrtf((float) ((cx - sx) * (cx - sx) + (cy - sy) * (cy - sy)));
+							dist = fminf(dist, inside ? d - edgeDistance(gx, gy, a) : d + edgeDistance(gx, gy, a));
+						}
+					}
+				}
+				if (!inside) dist = -dist;
+				*pDst = (unsigned char) dle::clamp((int) (128.f + dist * 127.f / (float) field.spread + .5f), 0, 255);
+			}
+		}
+
+		return field;
+	}
+
+	DistanceField bakeDistanceField(const void* src, const Size& srcSize, const int spread, const int downsample) {
+		return dle::bakeAlphaDistanceField(&((const Color*) src)->a, sizeof(Color), srcSize, spread, downsample);
+	}
+
+	DistanceField Layer::bakeDistanceField(const int spread, const int downsample) const {
+		// Alpha is the last component of both RGBA and BGRA
+		if (format == kPixelFormat_A8) return dle::bakeAlphaDistanceField(src, 1, size, spread, downsample);
+		return dle::bakeAlphaDistanceField(src + offsetof(Color, a), sizeof(Color), size, spread, downsample);
+	}
+
+	// Bilinear sample of the field, returns the distance to the edge in source pixels.
+	// Positive inside the shape.
+	float sampleDistanceField(const DistanceField& field, float fx, float fy) {
+		fx = (fx - (float) (field.downsample / 2) - .5f) / (float) field.downsample;
+		fy = (fy - (float) (field.downsample / 2) - .5f) / (float) field.downsample;
+		const int x0 = (int) floorf(fx);
+		const int y0 = (int) floorf(fy);
+		const float tx = fx - (float) x0;
+		const float ty = fy - (float) y0;
+		const int xa = dle::clamp(x0, 0, field.size.width - 1);
+		const int xb = dle::clamp(x0 + 1, 0, field.size.width - 1);
+		const int ya = dle::clamp(y0, 0, field.size.height - 1);
+		const int yb = dle::clamp(y0 + 1, 0, field.size.height - 1);
+		const unsigned char* pData = field.data.data();
+		const float top = (float) pData[ya * field.size.width + xa] * (1.f - tx) + (float) pData[ya * field.size.width + xb] * tx;
+		const float bottom = (float) pData[yb * field.size.width + xa] * (1.f - tx) + (float) pData[yb * field.size.width + xb] * tx;
+		return (top * (1.f - ty) + bottom * ty - 128.f) * (float) field.spread / 127.f;
+	}
+
+	inline int coverage(float dist) {
+		return dle::clamp((int) ((dist + .5f) * 255.f), 0, 255);
+	}
+
+	void renderDistanceFieldPS(Color* dst, int yStart, int yEnd, const Size& dstSize, const DistanceField& field, const Color& color,
+		const Outline* outline, const Glow* glow, const Shadow* shadow) {
+		// Source pixels per destination pixel, and the inverse to antialias in destination pixels
+		const float scaleX = (float) (field.size.width * field.downsample) / (float) dstSize.width;
+		const float scaleY = (float) (field.size.height * field.downsample) / (float) dstSize.height;
+		const float pxScale = 1.f / scaleX;
+		Color final;
+		dst += yStart * dstSize.width;
+		for (int y = yStart; y < yEnd; ++y) {
+			const float fy = ((float) y + .5f) * scaleY;
+			for (int x = 0; x < dstSize.width; ++x, ++dst) {
+				const float fx = ((float) x + .5f) * scaleX;
+				const float dist = sampleDistanceField(field, fx, fy);
+
+				if (shadow) {
+					// A box blur of size N spreads the edge over 2N + 1 pixels
+					const float shadowDist = sampleDistanceField(field, fx - (float) shadow->offset.x, fy - (float) shadow->offset.y);
+					final = shadow->color;
+					final.a = dle::clamp((int) ((shadowDist / (float) (shadow->size * 2 + 1) + .5f) * 255.f), 0, 255) * shadow->color.a / 255;
+					blend(*dst, *dst, final, shadow->blendMode);
+				}
+				if (glow) {
+					final = glow->color;
+					final.a = dle::clamp((int) ((dist / (float) dle::max(glow->size, 1) + 1.f) * 255.f), 0, 255) * glow->color.a / 255;
+					blend(*dst, *dst, final, glow->blendMode);
+				}
+				if (outline) {
+					final = outline->color;
+					final.a = coverage((dist + (float) outline->size) * pxScale) * outline->color.a / 255;
+					blend(*dst, *dst, final, outline->blendMode);
+				}
+
+				final = color;
+				final.a = coverage(dist * pxScale) * color.a / 255;
+				blend(*dst, *dst, final, kBlendMode_Normal);
+			}
+		}
+	}
+
+	void renderDistanceField(void* in_dst, const Size& dstSize, const DistanceField& field, const Color& color,
+		const Outline* outline, const Glow* glow, const Shadow* shadow) {
+		if (!field.data.size()) return;
+
+		Color* dst = (Color*) in_dst;
+		auto threadCount = dle::getThreadCount();
+		std::vector<std::future<void>> workers;
+		unsigned int i;
+		for (i = 0; i < threadCount - 1; ++i) {
+			workers.push_back(std::async(dle::renderDistanceFieldPS, dst, dstSize.height * i / threadCount, dstSize.height * (i + 1) / threadCount,
+				dstSize, std::cref(field), color, outline, glow, shadow));
+		}
+		dle::renderDistanceFieldPS(dst, dstSize.height * i / threadCount, dstSize.height * (i + 1) / threadCount,
+			dstSize, field, color, outline, glow, shadow);
+		for (auto& worker : workers) worker.wait();
 	}
-	
 }
@@ -1,10 +1,26 @@
 #ifndef DLE_H_INCLUDED
 #define DLE_H_INCLUDED
 
+#include <string.h>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <future>
 
 namespace dle
 {
+	/**
+		Set the number of threads effects and layers are split across.
+
+		@param count Number of threads. 0 uses the hardware concurrency
+	*/
+	void setThreadCount(const unsigned int count);
+
+	/**
+		Number of threads effects and layers are split across
+	*/
+	unsigned int getThreadCount();
+
 	/**
 		Blend modes enum. All blend values are calculated, then interpolated
 		by the source opacity.
@@ -12,6 +28,15 @@ namespace dle
 		s = Source color, top layer
 		d = Destination color, underlying layer
 
+		Lum, Sat, SetLum and SetSat are the non separable functions of the W3C
+		compositing spec, with luminance weights 0.3, 0.59 and 0.11. They work in
+		fixed point, within 1 of the formulas in floating point. Where d is
+		transparent, their result fades to s. They take up to two divisions per
+		pixel: on one core, a row blends in about 1 to 2 times the time of
+		Multiply, with a source per pixel or a single source color, like
+		ColorOverlay. Darker and Lighter Color are the fastest, Hue and
+		Saturation the slowest.
+
 		Only commented ones are implemented so far.
 
 		TODO: This will have to change into types, so we can use templates to
@@ -25,14 +50,14 @@ namespace dle
 		kBlendMode_Multiply,		/**< f(sd) = s * d */
 		kBlendMode_ColorBurn,
 		kBlendMode_LinearBurn,
-		kBlendMode_DarkerColor,
+		kBlendMode_DarkerColor,		/**< f(sd) = Lum(s) < Lum(d) ? s : d */
 
 		kBlendMode_Lighten,
 		kBlendMode_Screen,			/**< f(sd) = 1 - (1 - s) * (1 - d) */
 		kBlendMode_ColorDodge,
 		kBlendMode_LinearDodge,
 		kBlendMode_Additive = kBlendMode_LinearDodge,
-		kBlendMode_LighterColor,
+		kBlendMode_LighterColor,	/**< f(sd) = Lum(s) > Lum(d) ? s : d */
 
 		kBlendMode_Overlay,
 		kBlendMode_SoftLight,
@@ -47,10 +72,19 @@ namespace dle
 		kBlendMode_Substract,
 		kBlendMode_Divide,
 
-		kBlendMode_Hue,
-		kBlendMode_Saturation,
-		kBlendMode_Color,
-		kBlendMode_Luminosity,
+		kBlendMode_Hue,				/**< f(sd) = SetLum(SetSat(s, Sat(d)), Lum(d)) */
+		kBlendMode_Saturation,		/**< f(sd) = SetLum(SetSat(d, Sat(s)), Lum(d)) */
+		kBlendMode_Color,			/**< f(sd) = SetLum(s, Lum(d)) */
+		kBlendMode_Luminosity,		/**< f(sd) = SetLum(d, Lum(s)) */
+	};
+
+	/**
+		Pixel formats of the images given to layers and effects.
+	*/
+	enum ePixelFormat {
+		kPixelFormat_RGBA,	/**< 32 bits per pixel, components RGBA in this exact order. Same as the Color structure */
+		kPixelFormat_BGRA,	/**< 32 bits per pixel, components BGRA in this exact order */
+		kPixelFormat_A8,	/**< 8 bits of alpha per pixel, like font coverage bitmaps. Only for sources, colored with the layer fill color */
 	};
 
 	/**
@@ -86,6 +120,16 @@ namespace dle
 		int height;
 	};
 
+	/**
+		Margin of an image around its source alpha, on each side, in pixels
+	*/
+	struct Extent {
+		int left;
+		int top;
+		int right;
+		int bottom;
+	};
+
 	/**
 		Gradient key structure.
 		Gradients are formed of multiple keys. With color and percentage along
@@ -97,11 +141,72 @@ namespace dle
 	};
 
 	/**
-		Base effect class. Pure virtual, can not be instanciated.
-		To create a new effect, derive from it and implement apply()
+		Single channel signed distance field, built from an image alpha.
+		Each texel stores the distance to the alpha edge. 128 is on the edge,
+		255 is \a spread pixels inside the shape and 0 is \a spread pixels outside.
+	*/
+	struct DistanceField {
+		Size						size;		/**< Dimension of \a data. Source size divided by \a downsample, rounded up */
+		int							spread;		/**< Distance in source pixels covered by the full value range, on each side of the edge */
+		int							downsample;	/**< Reduction factor from the source image to \a data */
+		std::vector<unsigned char>	data;		/**< Distance values, size.width * size.height */
+	};
+
+	/**
+		Blend a color over another, the same way layers and effects do.
+
+		@param out Result of the blend. Can be the same as \a dst
+		@param dst Destination color, underlying layer
+		@param src Source color, top layer
+		@param blendMode Blend mode to apply \a src to \a dst
+	*/
+	void blend(Color& out, const Color& dst, const Color& src, const eBlendMode& blendMode);
+
+	/**
+		Blend a row of colors, the same as blend() on each pixel. The blend mode
+		is picked once for the row instead of once per pixel.
+
+		@param out Result of the blend, \a count colors. Can be the same as \a dst
+		@param dst Destination colors, underlying layer
+		@param src Source colors, top layer. Can be the same as \a out
+		@param srcStep Pixels to advance \a src by after each pixel. 0 blends the
+		same source color over the whole row
+		@param count Number of pixels
+		@param blendMode Blend mode to apply \a src to \a dst
+	*/
+	void blendRow(Color* out, const Color* dst, const Color* src, const int srcStep, const int count, const eBlendMode& blendMode);
+
+	/**
+		How an effect accesses the layer buffers. Layer::bake uses this to
+		avoid copying the whole layer before each effect.
+	*/
+	enum eEffectAccess {
+		kEffectAccess_InPlace,			/**< dst and src are the same buffer. Each pixel only reads itself before being written */
+		kEffectAccess_SeparateSource,	/**< src is a separate buffer. dst content is undefined, and every pixel must be written */
+		kEffectAccess_BaseLayer,		/**< Only writes to the base layer, from the alpha of src. dst and src are the same buffer and must be left untouched. Implement applyAlphaRows() */
+	};
+
+	/**
+		Base effect class, it does nothing on its own.
+		To create a new effect, derive from it and implement apply(), or
+		getAccess() and applyRows() to let the layer split the work across
+		threads. One of them must be implemented, their defaults run each
+		other. Effects that need a whole pass over the image before they can
+		write, like a blur, split their work in multiple passes.
 	*/
 	class Effect {
 	public:
+		/**
+			Virtual destructor.
+		*/
+		virtual ~Effect() {}
+
+		/**
+			Buffer access pattern of apply(). See eEffectAccess. Defaults to
+			kEffectAccess_SeparateSource
+		*/
+		virtual eEffectAccess getAccess() const;
+
 		/**
 			Apply the effect.
 
@@ -110,19 +215,111 @@ namespace dle
 			own blending to this layer. Not all effects will care about this
 			argument.
 
-			@param dst Destination image. This is the current layer with 
-			combined effects that were set before this one. This is were normal
-			effects will write to. For special things like glow, look at 
-			\a baseLayer .
+			@param dst Destination image. This is were normal effects will
+			write to. For special things like glow, look at \a baseLayer .
+			Depending on getAccess(), this is either the same buffer as \a src,
+			or a separate buffer that must be fully written.
 
 			@param src Source image. This is the current layer with combined
-			effects that were set before this one. It's in for reference and
-			seperated buffer from \a dst.
+			effects that were set before this one.
 
 			@param srcSize Size of the image. All buffers passed must be of size
 			srcSize.width * srcSize.height
+
+			The default runs every pass of applyRows(), across threads.
+		*/
+		virtual void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+
+		/**
+			Number of passes of applyRows(). Every row of a pass is done before the
+			next pass starts.
+		*/
+		virtual int getPassCount() const;
+
+		/**
+			Number of colors of scratch memory the passes share. See applyRows()
 		*/
-		virtual void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const = 0;
+		virtual int getScratchSize(const Size& srcSize) const;
+
+		/**
+			Size of the alpha blur done by the first two passes, or -1 if the effect
+			doesn't start with one. Those passes only read the alpha of src and
+			write the scratch memory, which the next passes only read. Effects with
+			the same blur size on the same source leave the same scratch memory, so
+			they can share it. See Animation.
+		*/
+		virtual int getAlphaBlurSize() const;
+
+		/**
+			Transparent margin the effect needs around the alpha it reads, on each
+			side: how far it draws past that alpha, and how far it reads around it.
+			Layers padded by their extent bake the same as with any larger margin,
+			except for effects sized from the layer, like gradients. See Layer::getExtent()
+		*/
+		virtual Extent getExtent() const;
+
+		/**
+			Apply one pass of the effect to a range of rows. Ranges of a same pass
+			can run in parallel and in any order. \a src doesn't change during the
+			effect, except for the pixels the effect writes itself in place.
+
+			@param baseLayer, dst, src, srcSize See apply()
+
+			@param scratch Memory of getScratchSize() colors, kept between the
+			passes of the effect
+
+			@param pass Index of the pass, from 0 to getPassCount() - 1
+
+			@param yStart, yEnd Rows to process, yEnd excluded
+
+			The default is for effects that only implement apply(): the range
+			starting at row 0 copies \a src to \a dst, then applies the effect
+			to the whole image, the other ranges do nothing.
+		*/
+		virtual void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+
+		/**
+			Create a copy of the effect for an image downscaled by \a factor. Sizes
+			and offsets are divided, so the look stays the same at lower resolution.
+			The caller owns the returned effect.
+
+			The default returns an effect that runs this one unchanged, which must
+			outlive it.
+		*/
+		virtual Effect* scaled(const int factor) const;
+
+		/**
+			Create an effect between this one and \a to, for animations. Colors,
+			sizes, offsets and angles are interpolated, the blend mode is the one
+			of this effect. The caller owns the returned effect.
+
+			@param to Effect of the same type
+
+			@param t Position between this effect, at 0, and \a to, at 1
+
+			The default returns an effect that runs this one before t reaches .5,
+			and \a to after. Both must outlive it.
+		*/
+		virtual Effect* interpolated(const Effect& to, const float t) const;
+
+		/**
+			Apply one pass of the effect from the alpha of the layer only. Layers
+			with A8 sources use it to run kEffectAccess_BaseLayer effects without
+			expanding their source, which those effects must support.
+
+			@param baseLayer, scratch, srcSize, pass, yStart, yEnd See applyRows()
+
+			@param srcAlpha Alpha of the first pixel of the layer
+
+			@param alphaStride Bytes from a pixel alpha to the next one. 1 for A8, 4 for Colors
+		*/
+		virtual void applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+
+		/**
+			Apply the effect from the alpha of the layer only. Runs every pass of
+			applyAlphaRows(), the same way apply() does.
+		*/
+		virtual void applyAlpha(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, const Size& srcSize) const;
 	};
 
 	/**
@@ -133,7 +330,10 @@ namespace dle
 		Color		color;		/**< Color of the overlay */
 		eBlendMode	blendMode;	/**< Blend mode to apply \a color to the layer */
 		ColorOverlay(const Color& in_color = { 255, 0, 0, 255 }, const eBlendMode in_blendMode = kBlendMode_Normal);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
 	};
 
 	/**
@@ -145,7 +345,13 @@ namespace dle
 	public:
 		int			size;		/**< Size of the blur. 0 = no blur. 5 = 9x9 blur, where {5,5} is the center. */
 		Blur(const int size);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		Extent getExtent() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
 	};
 
 	/**
@@ -160,7 +366,15 @@ namespace dle
 		int			size;		/**< Thickness of the outline */
 		eBlendMode	blendMode;	/**< Blend mode to apply \a color to the underlying image */
 		Outline(const Color& color = { 0, 0, 0, 245 }, const int size = 2, const eBlendMode blendMode = kBlendMode_Normal);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		Extent getExtent() const;
+		int getAlphaBlurSize() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
+		void applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
 	};
 
 	/**
@@ -173,7 +387,15 @@ namespace dle
 		int			size;		/**< Size of the blur. 0 = no blur. 5 = 9x9 blur, where {5,5} is the center. */
 		eBlendMode	blendMode;	/**< Blend mode to apply the shadow to the underlying image */
 		Shadow(const Color& color = { 0, 0, 0, 255 }, const Offset& offset = { 3, 5 }, const int size = 5, const eBlendMode blendMode = kBlendMode_Multiply);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		Extent getExtent() const;
+		int getAlphaBlurSize() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
+		void applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
 	};
 	
 	/**
@@ -186,7 +408,14 @@ namespace dle
 		int			size;		/**< Size of the blur. 0 = no blur. 5 = 9x9 blur, where {5,5} is the center. */
 		eBlendMode	blendMode;	/**< Blend mode to apply the shadow to the layer */
 		InnerShadow(const Color& color = { 0, 0, 0, 245 }, const Offset& offset = { 3, 3 }, const int size = 3, const eBlendMode in_blendMode = kBlendMode_Multiply);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		int getAlphaBlurSize() const;
+		Extent getExtent() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
 	};
 
 	/**
@@ -198,7 +427,15 @@ namespace dle
 		int			size;		/**< Size of the glow from the edges */
 		eBlendMode	blendMode;	/**< Blend mode to apply the glow to the underlying image */
 		Glow(const Color& color = { 255, 255, 190, 150 }, const int size = 5, const eBlendMode blendMode = kBlendMode_Screen);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		Extent getExtent() const;
+		int getAlphaBlurSize() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
+		void applyAlphaRows(Color* baseLayer, const unsigned char* srcAlpha, const int alphaStride, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
 	};
 
 	/**
@@ -212,14 +449,19 @@ namespace dle
 		int			size;		/**< Size of the glow from the edges */
 		eBlendMode	blendMode;	/**< Blend mode to apply the glow to the layer */
 		InnerGlow(const Color& color = {255, 255, 190, 150}, const int size = 5, const eBlendMode blendMode = kBlendMode_Screen);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		int getAlphaBlurSize() const;
+		Extent getExtent() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
 	};
 
 	/**
 		This is like ColorOverlay, but uses a linear gradient instead
 		of a fill color.
-
-		TODO: Add RadialGradient effect
 	*/
 	class Gradient final : public Effect {
 	public:
@@ -227,7 +469,76 @@ namespace dle
 		int angle;						/**< Angle of the gradient. 0 is North, then goes Counter-Clockwise*/
 		eBlendMode blendMode;			/**< Blend mode to apply the gradient to the layer */
 		Gradient(const std::vector<GradientKey>& keys = {}, int angle = 0, const eBlendMode blendMode = kBlendMode_Normal);
-		void apply(Color* baseLayer, Color* dst, Color* src, const Size& srcSize) const;
+		eEffectAccess getAccess() const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
+	};
+
+	/**
+		This is like Gradient, but the keys are laid out from a center point
+		outward. Using a different radius on x and y gives an elliptical gradient.
+	*/
+	class RadialGradient final : public Effect {
+	public:
+		std::vector<GradientKey> keys;	/**< Gradient key frames. 0 percent is the center, 100 percent is the radius */
+		Offset center;					/**< Center of the gradient, in percentage of the layer size. {50,50} is the middle of the layer */
+		Size radius;					/**< Radius of the gradient in pixels, along x and y. {0,0} reaches the farthest edges of the layer */
+		eBlendMode blendMode;			/**< Blend mode to apply the gradient to the layer */
+		RadialGradient(const std::vector<GradientKey>& keys = {}, const Offset& center = { 50, 50 }, const Size& radius = { 0, 0 }, const eBlendMode blendMode = kBlendMode_Normal);
+		eEffectAccess getAccess() const;
+		int getPassCount() const;
+		int getScratchSize(const Size& srcSize) const;
+		void applyRows(Color* baseLayer, Color* dst, Color* src, Color* scratch, const Size& srcSize, const int pass, const int yStart, const int yEnd) const;
+		Effect* scaled(const int factor) const;
+		Effect* interpolated(const Effect& to, const float t) const;
+	};
+
+	/**
+		State of an asynchronous bake
+	*/
+	enum eBakeStatus {
+		kBakeStatus_Pending,	/**< Waiting in the queue */
+		kBakeStatus_Running,	/**< Effects are being applied */
+		kBakeStatus_Done,		/**< The destination buffer holds the result */
+		kBakeStatus_Cancelled,	/**< Stopped before the end. The destination buffer content is undefined */
+	};
+
+	struct AsyncBakeJob;
+
+	/**
+		Handle to an asynchronous bake, returned by Layer::bakeAsync.
+		Copies of a handle refer to the same bake.
+	*/
+	class BakeHandle {
+	public:
+		BakeHandle(const std::shared_ptr<AsyncBakeJob>& job);
+
+		/**
+			Current state of the bake
+		*/
+		eBakeStatus getStatus() const;
+
+		/**
+			Stop the bake. A pending bake never starts, a running one stops before its
+			next chunk of rows. A bake that is already done stays done.
+		*/
+		void cancel();
+
+		/**
+			Block until the bake is done or cancelled.
+
+			@return true if the bake completed
+		*/
+		bool wait() const;
+
+		/**
+			Future resolved when the bake ends. true if it completed, false if it was cancelled
+		*/
+		std::shared_future<bool> getFuture() const;
+
+	private:
+		std::shared_ptr<AsyncBakeJob> job;
 	};
 
 	/**
@@ -244,6 +555,7 @@ namespace dle
 	public:
 		Size				size;		/**< Dimension of the layer. All layers in a same process should be of the exact same size */
 		eBlendMode			blendMode;	/**< Blend mode to apply the layer to the underlying layer */
+		Color				fill;		/**< Color of kPixelFormat_A8 sources. Their alpha is multiplied by fill.a */
 
 		/**
 			Constructor
@@ -256,9 +568,27 @@ namespace dle
 			@param in_blendMode Blend mode to apply the layer to the underlying layer
 		*/
 		Layer(const void* in_src, const Size& in_size, const eBlendMode in_blendMode = kBlendMode_Normal) :
-			size(in_size), blendMode(in_blendMode) {
-			src = new Color[size.width * size.height];
-			memcpy(src, in_src, sizeof(Color) * size.width * size.height);
+			Layer(in_src, in_size, kPixelFormat_RGBA, Color{ 255, 255, 255, 255 }, in_blendMode) {}
+
+		/**
+			Constructor, for sources that are not RGBA. The source is kept in its own
+			format, and only expanded when an effect needs its colors.
+
+			@param in_src Source image, in \a in_format.
+
+			@param in_size Size of the source image. \a in_src should be of size in_size.width * in_size.height
+
+			@param in_format Pixel format of \a in_src
+
+			@param in_fill Color of kPixelFormat_A8 sources. Ignored by the other formats
+
+			@param in_blendMode Blend mode to apply the layer to the underlying layer
+		*/
+		Layer(const void* in_src, const Size& in_size, const ePixelFormat in_format, const Color& in_fill = { 255, 255, 255, 255 }, const eBlendMode in_blendMode = kBlendMode_Normal) :
+			size(in_size), blendMode(in_blendMode), fill(in_fill), format(in_format) {
+			const int bytes = size.width * size.height * (format == kPixelFormat_A8 ? 1 : (int) sizeof(Color));
+			src = new unsigned char[bytes];
+			memcpy(src, in_src, bytes);
 		}
 
 		/**
@@ -274,9 +604,21 @@ namespace dle
 			@param effects List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
 			Those effects will be applied in the same order that they are added to the layer.
 		*/
-		template<typename... Effects> Layer(const void* in_src, const Size& in_size, const eBlendMode in_blendMode, const Effects&... effects) : size(in_size), blendMode(in_blendMode) {
-			src = new Color[size.width * size.height];
-			memcpy(src, in_src, sizeof(Color) * size.width * size.height);
+		template<typename... Effects> Layer(const void* in_src, const Size& in_size, const eBlendMode in_blendMode, const Effects&... effects) :
+			Layer(in_src, in_size, in_blendMode) {
+			addEffect(effects...);
+		}
+
+		/**
+			Constructor, for sources that are not RGBA.
+
+			@param in_src, in_size, in_format, in_fill, in_blendMode See the constructor above
+
+			@param effects List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
+			Those effects will be applied in the same order that they are added to the layer.
+		*/
+		template<typename... Effects> Layer(const void* in_src, const Size& in_size, const ePixelFormat in_format, const Color& in_fill, const eBlendMode in_blendMode, const Effects&... effects) :
+			Layer(in_src, in_size, in_format, in_fill, in_blendMode) {
 			addEffect(effects...);
 		}
 
@@ -302,9 +644,7 @@ namespace dle
 			@param effect Effect to add
 		*/
 		template<typename T> void addEffect(const T& effect) {
-			T* pEffect = new T();
-			*pEffect = effect;
-			effects.push_back(pEffect);
+			effects.push_back(new T(effect));
 		}
 
 		/**
@@ -315,11 +655,349 @@ namespace dle
 		virtual void bake(Color* dst) const;
 		void bake(void* dst) const;
 
+		/**
+			Bake all the effects of the layer to a destination buffer that is not RGBA.
+			The conversion is done while blending, without extra copies.
+
+			@param dst Destination buffer for the layer to be baked to
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+		*/
+		void bake(Color* dst, const ePixelFormat dstFormat) const;
+		void bake(void* dst, const ePixelFormat dstFormat) const;
+
+		/**
+			Bake all the effects of the layer to a region of a bigger image, like an
+			atlas slot.
+
+			@param dst First pixel of the region
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+
+			@param dstStride Number of pixels from a row of \a dst to the next
+		*/
+		void bake(void* dst, const ePixelFormat dstFormat, const int dstStride) const;
+
+		/**
+			Bake all the effects of the layer, stopping between chunks of rows if
+			\a cancelled becomes true.
+
+			@param dst Destination buffer for the layer to be baked to. Its content is
+			undefined if the bake is cancelled
+
+			@param cancelled Flag checked before every chunk of rows, of about 32k
+			pixels per thread
+
+			@return true if the bake completed
+		*/
+		bool bake(Color* dst, const std::atomic<bool>& cancelled) const;
+		bool bake(void* dst, const ePixelFormat dstFormat, const std::atomic<bool>& cancelled) const;
+		bool bake(void* dst, const ePixelFormat dstFormat, const int dstStride, const std::atomic<bool>& cancelled) const;
+
+		/**
+			Bake the layer on a background thread. Bakes run one at a time, highest
+			priority first, then in the order they were requested. The layer and
+			\a dst must stay alive until the bake is done or cancelled.
+
+			@param dst Destination buffer for the layer to be baked to
+
+			@param priority Higher priorities bake first. i.e: Visible UI text before the rest
+		*/
+		BakeHandle bakeAsync(Color* dst, const int priority = 0) const;
+		BakeHandle bakeAsync(void* dst, const int priority = 0) const;
+		BakeHandle bakeAsync(void* dst, const ePixelFormat dstFormat, const int priority = 0) const;
+
+		/**
+			Bake the layer at a lower resolution, for quick feedback while editing.
+			The source is downscaled, and effect sizes and offsets are scaled to match.
+
+			@param dst Destination buffer of size previewSize(size, factor). Like
+			with bake(), it holds the underlying image, downscaled. See downscale()
+
+			@param factor Reduction factor, i.e: 2, 4 or 8. 1 is a full bake
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+		*/
+		void bakePreview(void* dst, const int factor, const ePixelFormat dstFormat = kPixelFormat_RGBA) const;
+
+		/**
+			Bake a preview right away, then refine to full resolution in the background.
+
+			@param previewDst Destination of the preview. See bakePreview()
+
+			@param factor Reduction factor of the preview
+
+			@param dst Destination of the full resolution bake. See bakeAsync()
+
+			@param priority Priority of the full resolution bake
+
+			@param dstFormat Pixel format of both destinations
+
+			@return Handle of the full resolution bake
+		*/
+		BakeHandle bakeProgressive(void* previewDst, const int factor, void* dst, const int priority = 0, const ePixelFormat dstFormat = kPixelFormat_RGBA) const;
+
+		/**
+			Build a signed distance field from the alpha of the layer's source image.
+			Effects are not baked, use renderDistanceField to rebuild them at any scale.
+
+			@param spread Distance in source pixels covered on each side of the edge.
+			Should be at least as big as the effects you plan to render from it.
+
+			@param downsample Reduction factor of the field. 1 keeps the source resolution
+		*/
+		DistanceField bakeDistanceField(const int spread = 8, const int downsample = 4) const;
+
+		/**
+			Transparent margin the effects of the layer need around its source
+			alpha, on each side. See Effect::getExtent(). Blurs grow the alpha that
+			the following effects read, and read the colors the effects before them
+			left near the borders.
+		*/
+		Extent getExtent() const;
+
+		/**
+			Source image of the layer, of size size.width * size.height, in getFormat()
+		*/
+		const void* getSource() const { return src; }
+
+		/**
+			Pixel format of the source image
+		*/
+		ePixelFormat getFormat() const { return format; }
+
+		/**
+			Expand the source image to RGBA, like the effects see it.
+
+			@param dst Destination image, of size size.width * size.height
+		*/
+		void expandSource(Color* dst) const;
+
+		/**
+			Effects of the layer, in the order they are applied
+		*/
+		const std::vector<Effect*>& getEffects() const { return effects; }
+
 	protected:
-		Color*					src;
+		friend class Animation;
+		friend class Atlas;
+
+		/**
+			Constructor of a transparent layer, for friends filling the source themselves
+		*/
+		Layer(const Size& in_size, const ePixelFormat in_format, const Color& in_fill, const eBlendMode in_blendMode);
+
+		ePixelFormat			format;
+		unsigned char*			src;
 		std::vector<Effect*>	effects;
 	};
 
+	/**
+		Bake of a layer that can be spread over multiple calls, for real time use.
+		Call step() with a time budget, every frame for example, until it returns
+		true. The result is the same as Layer::bake. The layer and the destination
+		buffer must stay alive until the bake is done.
+	*/
+	class BakeJob {
+	public:
+		/**
+			Constructor
+
+			@param layer Layer to bake
+
+			@param dst Destination buffer for the layer to be baked to
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+		*/
+		BakeJob(const Layer& layer, void* dst, const ePixelFormat dstFormat = kPixelFormat_RGBA);
+
+		/**
+			Continue the bake until the time budget is used. At least one chunk of
+			rows is processed per call, so the budget can be slightly exceeded.
+
+			@param milliseconds Time budget of this step
+
+			@return true once the bake is done
+		*/
+		bool step(const float milliseconds);
+
+		/**
+			Returns true once the destination buffer holds the result
+		*/
+		bool isDone() const;
+
+		/**
+			Approximate progress of the bake, from 0 to 1
+		*/
+		float getProgress() const;
+
+	private:
+		const Layer&				layer;
+		Color*						dst;
+		std::unique_ptr<Color[]>	img;				// Layer with the effects applied so far
+		std::unique_ptr<Color[]>	imgSrc;				// Second buffer, for effects needing a separate source
+		std::unique_ptr<Color[]>	scratch;			// Scratch memory of the current effect
+		int							scratchCapacity;
+		size_t						effectIndex;
+		int							pass;
+		int							row;
+		int							unitsDone;
+		int							unitCount;
+		float						rowTime;			// Milliseconds per row of the last chunk
+		ePixelFormat				dstFormat;
+		std::unique_ptr<unsigned char[]> fillAlpha;		// Alpha of A8 layers with a translucent fill
+		const unsigned char*		alpha;				// Alpha of A8 layers, until img is expanded
+		bool						dstSwizzled;		// BGRA destination turned to RGBA for the base layer effects
+		bool						done;
+	};
+
+	/**
+		Flip-book animation of a layer, like a pulsing glow or a turning gradient.
+		Effect parameters are keyframed, and interpolated for the frames between.
+		Work that is the same for every frame, the source expansion and the alpha
+		blurs of the effects that share a size, is done once, then the frames bake
+		in parallel.
+	*/
+	class Animation {
+	public:
+		/**
+			Constructor
+
+			@param layer Source, fill and blend mode of the frames. Its effects are
+			the keyframe at frame 0. The layer must stay alive as long as the animation.
+		*/
+		Animation(const Layer& layer);
+
+		/**
+			Destructor.
+		*/
+		~Animation();
+
+		/**
+			Add a keyframe. Its effects must be of the same types, in the same order,
+			as the effects of the layer. Frames after the last keyframe hold it.
+
+			@param frame Frame of the keyframe, after frame 0. Replaces the keyframe
+			already at that frame, if any
+
+			@param effect and effects; List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
+		*/
+		template<typename... Effects> void addKeyframe(const int frame, const Effects&... effects) {
+			std::vector<Effect*> keyEffects;
+			collectEffects(keyEffects, effects...);
+			addKeyframe(frame, keyEffects);
+		}
+
+		/**
+			Add a keyframe from effects created with new. The animation takes their ownership.
+		*/
+		void addKeyframe(const int frame, const std::vector<Effect*>& effects);
+
+		/**
+			Create the layer of a single frame, with its interpolated effects. The
+			caller owns the returned layer. Effects without their own interpolated()
+			are shared with the keyframes, so the layer must not outlive the animation.
+		*/
+		Layer* createFrame(const int frame) const;
+
+		/**
+			Bake frames [0, frameCount) of the animation.
+
+			@param dst Destination of the frames, one after the other. Each frame
+			is size.width * size.height pixels and, like with Layer::bake, holds the
+			underlying image.
+
+			@param frameCount Number of frames to bake
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+		*/
+		void bake(void* dst, const int frameCount, const ePixelFormat dstFormat = kPixelFormat_RGBA) const;
+
+	private:
+		struct Keyframe {
+			int						frame;
+			std::vector<Effect*>	effects;
+		};
+
+		template<typename T, typename... Effects> static void collectEffects(std::vector<Effect*>& list, const T& effect, const Effects&... effects) {
+			list.push_back(new T(effect));
+			collectEffects(list, effects...);
+		}
+		static void collectEffects(std::vector<Effect*>& list) {}
+
+		std::vector<Effect*> createEffects(const int frame) const;
+
+		const Layer&			layer;
+		std::vector<Keyframe>	keyframes;	// Sorted by frame. The effects of the first one belong to the layer
+	};
+
+	/**
+		Packs styled layers in a single image, like the glyphs of a font. Each
+		layer gets a slot fitting its source and the extent of its effects, then
+		bakes straight into it. The layers must stay alive until the atlas is baked.
+	*/
+	class Atlas {
+	public:
+		/**
+			Constructor
+
+			@param size Size of the atlas image
+
+			@param padding Transparent pixels kept between the slots
+		*/
+		Atlas(const Size& size, const int padding = 1);
+
+		/**
+			Add a layer. Call pack() once all the layers are added.
+
+			@return Index of the layer
+		*/
+		int add(const Layer& layer);
+
+		/**
+			Place the layers in rows, tallest first.
+
+			@return false if they don't all fit. Layers that don't fit get an empty slot
+		*/
+		bool pack();
+
+		/**
+			Slot of a layer in the atlas, covering its source and its extent. Valid after pack()
+		*/
+		Rect getSlot(const int index) const;
+
+		/**
+			Position of the top left pixel of a layer source in the atlas. Valid after pack()
+		*/
+		Offset getOrigin(const int index) const;
+
+		/**
+			Size of the atlas image
+		*/
+		const Size& getSize() const { return size; }
+
+		/**
+			Bake every packed layer into its slot.
+
+			@param dst Atlas image, of getSize(). Like with Layer::bake, it holds
+			the underlying image, usually transparent
+
+			@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+		*/
+		void bake(void* dst, const ePixelFormat dstFormat = kPixelFormat_RGBA) const;
+
+	private:
+		struct Sprite {
+			const Layer*	layer;
+			Extent			extent;
+			Rect			slot;
+		};
+
+		Size				size;
+		int					padding;
+		std::vector<Sprite>	sprites;
+	};
+
 	/**
 		Apply effects to an image buffer directly, without using layers.
 
@@ -353,6 +1031,66 @@ namespace dle
 		layer.bake((Color*) dst);
 	}
 
+	/**
+		Apply effects to an image buffer directly, in a format other than RGBA.
+
+		@param dstAndSrc Both source and destination image. The original image will
+		be overriden.
+
+		@param format Pixel format of \a dstAndSrc. kPixelFormat_RGBA or kPixelFormat_BGRA
+
+		@param srcSize Size of the source image
+
+		@param effects List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
+		Those effects will be applied in the same order that they are passed in
+	*/
+	template<typename... Effects> void applyEffects(void* dstAndSrc, const ePixelFormat format, const Size& srcSize, const Effects&... effects) {
+		Layer layer(dstAndSrc, srcSize, format, Color{ 255, 255, 255, 255 }, kBlendMode_Normal, effects...);
+		layer.bake(dstAndSrc, format);
+	}
+
+	/**
+		Apply effects to an image buffer directly, converting between formats.
+
+		@param dst Destination image where the final result will be stored
+
+		@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+
+		@param src Source image. This buffer will be left untouched
+
+		@param srcFormat Pixel format of \a src. kPixelFormat_RGBA or kPixelFormat_BGRA
+
+		@param srcSize Size of the source image
+
+		@param effects List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
+		Those effects will be applied in the same order that they are passed in
+	*/
+	template<typename... Effects> void applyEffects(void* dst, const ePixelFormat dstFormat, const void* src, const ePixelFormat srcFormat, const Size& srcSize, const Effects&... effects) {
+		Layer layer(src, srcSize, srcFormat, Color{ 255, 255, 255, 255 }, kBlendMode_Normal, effects...);
+		layer.bake(dst, dstFormat);
+	}
+
+	/**
+		Apply effects to an A8 image, like a font glyph, colored with a fill color.
+
+		@param dst Destination image where the final result will be stored
+
+		@param dstFormat Pixel format of \a dst. kPixelFormat_RGBA or kPixelFormat_BGRA
+
+		@param src A8 source image. This buffer will be left untouched
+
+		@param fill Color of the source. Its alpha is multiplied by the source alpha
+
+		@param srcSize Size of the source image
+
+		@param effects List of effects. i.e: dle::Shadow(), dle::Outline(), dle::ColorOverlay(), ...
+		Those effects will be applied in the same order that they are passed in
+	*/
+	template<typename... Effects> void applyEffects(void* dst, const ePixelFormat dstFormat, const void* src, const Color& fill, const Size& srcSize, const Effects&... effects) {
+		Layer layer(src, srcSize, kPixelFormat_A8, fill, kBlendMode_Normal, effects...);
+		layer.bake(dst, dstFormat);
+	}
+
 	/**
 		Apply multiple layers to an image buffer
 
@@ -368,6 +1106,61 @@ namespace dle
 		applyLayers(dst, srcSize, layers...);
 	}
 	void applyLayers(void* dst, const Size& srcSize, const Layer& layer);
+
+	/**
+		Size of an image downscaled by \a factor. Partial blocks on the edges are kept
+	*/
+	Size previewSize(const Size& srcSize, const int factor);
+
+	/**
+		Downscale an image by averaging blocks of factor * factor pixels.
+
+		@param dst Destination image, of size previewSize(srcSize, factor)
+
+		@param src Source image. This buffer will be left untouched
+
+		@param srcSize Size of the source image
+
+		@param factor Reduction factor
+	*/
+	void downscale(void* dst, const void* src, const Size& srcSize, const int factor);
+
+	/**
+		Build a signed distance field from an image alpha. Pixels with an alpha of
+		128 or more are inside the shape. The edge is placed inside partially
+		covered pixels from their coverage, so antialiased shapes keep sub-pixel
+		precision.
+
+		@param src Source image, RGBA. This buffer will be left untouched
+
+		@param srcSize Size of the source image
+
+		@param spread Distance in source pixels covered on each side of the edge
+
+		@param downsample Reduction factor of the field. 1 keeps the source resolution
+	*/
+	DistanceField bakeDistanceField(const void* src, const Size& srcSize, const int spread = 8, const int downsample = 4);
+
+	/**
+		Render a distance field at any size, rebuilding the look of the Shadow, Glow
+		and Outline effects. Effect sizes and offsets are in source image pixels,
+		and are scaled with the output. They are limited by the field's spread.
+
+		Effects are blended into \a dst with their blend mode, then \a color is
+		drawn on top, the same way Layer::bake would compose them.
+
+		@param dst Destination image, of size dstSize.width * dstSize.height
+
+		@param dstSize Size of the rendered image. Use the source size for a 1:1 render
+
+		@param field Distance field to render
+
+		@param color Fill color of the shape
+
+		@param outline, glow, shadow Optional effects to render. NULL to skip
+	*/
+	void renderDistanceField(void* dst, const Size& dstSize, const DistanceField& field, const Color& color = { 255, 255, 255, 255 },
+		const Outline* outline = NULL, const Glow* glow = NULL, const Shadow* shadow = NULL);
 }
 
 #endif
@@ -0,0 +1,13 @@
+#ifndef DLE_INTERNAL_H_INCLUDED
+#define DLE_INTERNAL_H_INCLUDED
+
+namespace dle
+{
+	/**
+		Sine of every degree, times 10000. Shared by the effects and their reference
+		implementation, so both rotate gradients the same way.
+	*/
+	extern int g_sintable[360];
+}
+
+#endif
@@ -0,0 +1,1163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#include <memory>
+#include "dle_reference.h"
+#include "dle_internal.h"
+
+
+namespace dle {
+
+	namespace reference {
+
+		static int min(int a, int b) {
+			return a < b ? a : b;
+		}
+
+		static int max(int a, int b) {
+			return a > b ? a : b;
+		}
+
+		static int clamp(int val, int in_min, int in_max) {
+			return min(max(val, in_min), in_max);
+		}
+
+		static void lerp(Color& out, const Color& a, const Color& b, const int t) {
+			int invT = 255 - t;
+
+			out.r = a.r * invT / 255 + b.r * t / 255;
+			out.g = a.g * invT / 255 + b.g * t / 255;
+			out.b = a.b * invT / 255 + b.b * t / 255;
+			out.a = a.a * invT / 255 + b.a * t / 255;
+		}
+
+		static void lerpPercentile(Color& out, const Color& a, const Color& b, const int t) {
+			int invT = 10000 - t;
+
+			out.r = a.r * invT / 10000 + b.r * t / 10000;
+			out.g = a.g * invT / 10000 + b.g * t / 10000;
+			out.b = a.b * invT / 10000 + b.b * t / 10000;
+			out.a = a.a * invT / 10000 + b.a * t / 10000;
+		}
+
+		static void lerpPreserveAlpha(Color& out, const Color& a, const Color& b, const int t) {
+			int invT = 255 - t;
+
+			out.r = a.r * invT / 255 + b.r * t / 255;
+			out.g = a.g * invT / 255 + b.g * t / 255;
+			out.b = a.b * invT / 255 + b.b * t / 255;
+			out.a = max(a.a, b.a);
+		}
+
+		// Exact, to compare colors
+		static int lumOrder(const Color& color) {
+			return 30 * color.r + 59 * color.g + 11 * color.b;
+		}
+
+		// Non separable modes, in floating point literally from the W3C compositing spec
+		struct Rgbf {
+			double c[3];
+		};
+
+		static double lumf(const Rgbf& color) {
+			return 0.3 * color.c[0] + 0.59 * color.c[1] + 0.11 * color.c[2];
+		}
+
+		static double satf(const Rgbf& color) {
+			return fmax(color.c[0], fmax(color.c[1], color.c[2])) - fmin(color.c[0], fmin(color.c[1], color.c[2]));
+		}
+
+		static Rgbf clipColorf(Rgbf color) {
+			const double l = lumf(color);
+			const double n = fmin(color.c[0], fmin(color.c[1], color.c[2]));
+			const double x = fmax(color.c[0], fmax(color.c[1], color.c[2]));
+			if (n < 0.0) for (int i = 0; i < 3; ++i) color.c[i] = l + (color.c[i] - l) * l / (l - n);
+			if (x > 1.0) for (int i = 0; i < 3; ++i) color.c[i] = l + (color.c[i] - l) * (1.0 - l) / (x - l);
+			return color;
+		}
+
+		static Rgbf setLumf(Rgbf color, const double l) {
+			const double d = l - lumf(color);
+			for (int i = 0; i < 3; ++i) color.c[i] += d;
+			return clipColorf(color);
+		}
+
+		static Rgbf setSatf(Rgbf color, const double s) {
+			const double n = fmin(color.c[0], fmin(color.c[1], color.c[2]));
+			const double x = fmax(color.c[0], fmax(color.c[1], color.c[2]));
+			for (int i = 0; i < 3; ++i) color.c[i] = x > n ? (color.c[i] - n) * s / (x - n) : 0.0;
+			return color;
+		}
+
+		static Color specBlend(const Color& dst, const Color& src, const eBlendMode& blendMode) {
+			const Rgbf d = { { dst.r / 255.0, dst.g / 255.0, dst.b / 255.0 } };
+			const Rgbf s = { { src.r / 255.0, src.g / 255.0, src.b / 255.0 } };
+			Rgbf result;
+			switch (blendMode) {
+			case kBlendMode_Hue: result = setLumf(setSatf(s, satf(d)), lumf(d)); break;
+			case kBlendMode_Saturation: result = setLumf(setSatf(d, satf(s)), lumf(d)); break;
+			case kBlendMode_Color: result = setLumf(s, lumf(d)); break;
+			case kBlendMode_Luminosity: result = setLumf(d, lumf(s)); break;
+			// Luminances that tie exactly would tie or not depending on the rounding
+			case kBlendMode_DarkerColor: return lumOrder(src) < lumOrder(dst) ? src : dst;
+			default: return lumOrder(src) > lumOrder(dst) ? src : dst;
+			}
+			Color color;
+			color.r = (unsigned char) clamp((int) floor(result.c[0] * 255.0 + 0.5), 0, 255);
+			color.g = (unsigned char) clamp((int) floor(result.c[1] * 255.0 + 0.5), 0, 255);
+			color.b = (unsigned char) clamp((int) floor(result.c[2] * 255.0 + 0.5), 0, 255);
+			color.a = 255;
+			return color;
+		}
+
+		// The optimized modes round within 1 of the spec, which runDifferential() and
+		// runBlendModes() check on their own. Stacks use the optimized colors, like
+		// approximate effects, since the effects after a mode can turn a rounding
+		// difference of near grays into a large one
+		static bool g_resyncBlendModes = true;
+
+		static Color nonSeparable(const Color& dst, const Color& src, const eBlendMode& blendMode) {
+			if (!g_resyncBlendModes) return specBlend(dst, src, blendMode);
+			Color opaqueDst = dst, opaqueSrc = src, color;
+			opaqueDst.a = opaqueSrc.a = 255;
+			dle::blend(color, opaqueDst, opaqueSrc, blendMode);
+			return color;
+		}
+
+		void blend(Color& out, const Color& dst, const Color& src, const eBlendMode& blendMode) {
+			Color tmpDst;
+			Color tmpOut;
+			switch (blendMode) {
+			case kBlendMode_Normal:
+				tmpOut.r = src.r;
+				tmpOut.g = src.g;
+				tmpOut.b = src.b;
+				tmpOut.a = min(255, dst.a + src.a);
+				lerp(out, dst, tmpOut, src.a);
+				break;
+			case kBlendMode_Multiply:
+				tmpOut.r = dst.r * src.r / 255;
+				tmpOut.g = dst.g * src.g / 255;
+				tmpOut.b = dst.b * src.b / 255;
+				tmpOut.a = min(255, dst.a + src.a);
+				lerp(out, dst, tmpOut, src.a);
+				break;
+			case kBlendMode_Screen:
+				lerpPreserveAlpha(tmpDst, src, dst, dst.a);
+				tmpOut.r = 255 - (255 - dst.r) * (255 - src.r) / 255;
+				tmpOut.g = 255 - (255 - dst.g) * (255 - src.g) / 255;
+				tmpOut.b = 255 - (255 - dst.b) * (255 - src.b) / 255;
+				tmpOut.a = min(255, dst.a + src.a);
+				lerp(out, tmpDst, tmpOut, src.a);
+				break;
+			case kBlendMode_Hue:
+			case kBlendMode_Saturation:
+			case kBlendMode_Color:
+			case kBlendMode_Luminosity:
+			case kBlendMode_DarkerColor:
+			case kBlendMode_LighterColor:
+				// Fades to the source where the destination is transparent, like screen
+				lerpPreserveAlpha(tmpOut, src, nonSeparable(dst, src, blendMode), dst.a);
+				tmpOut.a = min(255, dst.a + src.a);
+				lerp(out, dst, tmpOut, src.a);
+				break;
+			default:
+				out = dst;
+				break;
+			}
+		}
+
+		// Box blur over the flat image. Horizontal windows run across row ends,
+		// and the first and last size rows of dst are left untouched.
+		static void blurRows(Color* dst, const Color* src, const Size& srcSize, const int size) {
+			const int len = srcSize.width * srcSize.height;
+			const int sizeTotal = size * 2 + 1;
+			std::vector<Color> tmp(len);
+			memset(tmp.data(), 0, sizeof(Color) * len);
+
+			for (int i = size; i < len - size; ++i) {
+				int accum[4] = { 0, 0, 0, 0 };
+				for (int k = -size; k <= size; ++k) {
+					accum[0] += src[i + k].r;
+					accum[1] += src[i + k].g;
+					accum[2] += src[i + k].b;
+					accum[3] += src[i + k].a;
+				}
+				tmp[i].r = accum[0] / sizeTotal;
+				tmp[i].g = accum[1] / sizeTotal;
+				tmp[i].b = accum[2] / sizeTotal;
+				tmp[i].a = accum[3] / sizeTotal;
+			}
+
+			for (int i = size * srcSize.width; i < len - size * srcSize.width; ++i) {
+				int accum[4] = { 0, 0, 0, 0 };
+				for (int k = -size; k <= size; ++k) {
+					const Color& px = tmp[i + k * srcSize.width];
+					accum[0] += px.r;
+					accum[1] += px.g;
+					accum[2] += px.b;
+					accum[3] += px.a;
+				}
+				dst[i].r = accum[0] / sizeTotal;
+				dst[i].g = accum[1] / sizeTotal;
+				dst[i].b = accum[2] / sizeTotal;
+				dst[i].a = accum[3] / sizeTotal;
+			}
+		}
+
+		void blur(Color* dst, const Color* src, const Size& srcSize, const int size) {
+			memcpy(dst, src, sizeof(Color) * srcSize.width * srcSize.height);
+			blurRows(dst, src, srcSize, size);
+		}
+
+		// Blur used by the alpha driven effects. Unblurred rows are transparent
+		static std::vector<Color> alphaBlur(const Color* src, const Size& srcSize, const int size) {
+			std::vector<Color> blurImg(srcSize.width * srcSize.height);
+			memset(blurImg.data(), 0, sizeof(Color) * blurImg.size());
+			blurRows(blurImg.data(), src, srcSize, size);
+			return blurImg;
+		}
+
+		// Calls fn(i, k) for every pixel i shifted by offset, k being the pixel it comes from.
+		// The shift is done on the flat image, like the effects do.
+		template<typename Fn> static void forEachOffset(const Offset& offset, const Size& srcSize, Fn fn) {
+			const int len = srcSize.width * srcSize.height;
+			const int count = len - abs(offset.x) - abs(offset.y) * srcSize.width;
+			const int dstStart = max(offset.x, 0) + max(offset.y, 0) * srcSize.width;
+			const int srcStart = max(-offset.x, 0) + max(-offset.y, 0) * srcSize.width;
+			for (int i = 0; i < count; ++i) {
+				fn(dstStart + i, srcStart + i);
+			}
+		}
+
+		static void gradientKeyColor(Color& out, const std::vector<GradientKey>& keys, int percent) {
+			int localPercent = 0;
+			out = keys[0].color;
+			for (size_t i = 0; i < keys.size(); ++i) {
+				if (percent < keys[i].percent * 100) {
+					percent = (percent - localPercent * 100) * 10000 / (keys[i].percent * 100 - localPercent * 100);
+					lerpPercentile(out, out, keys[i].color, percent);
+					return;
+				}
+				out = keys[i].color;
+				localPercent = keys[i].percent;
+			}
+		}
+
+		static void applyColorOverlay(const ColorOverlay& fx, Color* dst, const Color* src, const Size& srcSize) {
+			for (int i = 0; i < srcSize.width * srcSize.height; ++i) {
+				reference::blend(dst[i], src[i], fx.color, fx.blendMode);
+				dst[i].a = src[i].a;
+			}
+		}
+
+		static void applyOutline(const Outline& fx, Color* baseLayer, const Color* src, const Size& srcSize) {
+			std::vector<Color> blurImg = alphaBlur(src, srcSize, fx.size);
+			int sizeP2 = 1;
+			while (sizeP2 < fx.size) sizeP2 *= 2;
+			if (sizeP2 > 32) sizeP2 = 32;
+			const int divider = 32 / sizeP2;
+			const int multiplier = 8 * sizeP2;
+			Color final = fx.color;
+			for (int i = 0; i < srcSize.width * srcSize.height; ++i) {
+				final.a = min(255, clamp(blurImg[i].a, 0, divider) * multiplier) * fx.color.a / 255;
+				reference::blend(baseLayer[i], baseLayer[i], final, fx.blendMode);
+			}
+		}
+
+		static void applyShadow(const Shadow& fx, Color* baseLayer, const Color* src, const Size& srcSize) {
+			std::vector<Color> blurImg = alphaBlur(src, srcSize, fx.size);
+			Color final = fx.color;
+			forEachOffset(fx.offset, srcSize, [&](int i, int k) {
+				final.a = blurImg[k].a * fx.color.a / 255;
+				reference::blend(baseLayer[i], baseLayer[i], final, fx.blendMode);
+			});
+		}
+
+		static void applyInnerShadow(const InnerShadow& fx, Color* dst, const Color* src, const Size& srcSize) {
+			std::vector<Color> blurImg = alphaBlur(src, srcSize, fx.size);
+			Color final = fx.color;
+			forEachOffset(fx.offset, srcSize, [&](int i, int k) {
+				final.a = (255 - blurImg[k].a) * fx.color.a / 255;
+				final.a = final.a * src[i].a / 255;
+				reference::blend(dst[i], src[i], final, fx.blendMode);
+			});
+		}
+
+		static void applyGlow(const Glow& fx, Color* baseLayer, const Color* src, const Size& srcSize) {
+			std::vector<Color> blurImg = alphaBlur(src, srcSize, fx.size);
+			Color final = fx.color;
+			for (int i = 0; i < srcSize.width * srcSize.height; ++i) {
+				final.a = min(255, clamp(blurImg[i].a, 0, 128) * 2) * fx.color.a / 255;
+				reference::blend(baseLayer[i], baseLayer[i], final, fx.blendMode);
+			}
+		}
+
+		static void applyInnerGlow(const InnerGlow& fx, Color* dst, const Color* src, const Size& srcSize) {
+			std::vector<Color> blurImg = alphaBlur(src, srcSize, fx.size);
+			Color final = fx.color;
+			for (int i = 0; i < srcSize.width * srcSize.height; ++i) {
+				final.a = 255 - min(255, (clamp(blurImg[i].a, 127, 255) - 127) * 2);
+				final.a = final.a * fx.color.a / 255;
+				final.a = final.a * src[i].a / 255;
+				reference::blend(dst[i], dst[i], final, fx.blendMode);
+			}
+		}
+
+		static void applyGradient(const Gradient& fx, Color* dst, const Color* src, const Size& srcSize) {
+			if (!fx.keys.size()) return;
+
+			const int sintheta = g_sintable[fx.angle] / 100;
+			const int costheta = g_sintable[(fx.angle + 90) % 360] / 100;
+			const int size = abs(sintheta * srcSize.width) + abs(costheta * srcSize.height);
+			Color final;
+			for (int y = 0; y < srcSize.height; ++y) {
+				for (int x = 0; x < srcSize.width; ++x) {
+					const int px = sintheta >= 0 ? x * sintheta : (srcSize.width - x) * -sintheta;
+					const int py = costheta >= 0 ? y * costheta : (srcSize.height - y) * -costheta;
+					const int percent = clamp((px + py) * 10000 / size, 0, 10000);
+					gradientKeyColor(final, fx.keys, percent);
+
+					const int i = y * srcSize.width + x;
+					final.a = src[i].a * final.a / 255;
+					reference::blend(dst[i], dst[i], final, fx.blendMode);
+				}
+			}
+		}
+
+		static void applyRadialGradient(const RadialGradient& fx, Color* dst, const Color* src, const Size& srcSize) {
+			if (!fx.keys.size()) return;
+
+			const int cx = srcSize.width * fx.center.x / 100;
+			const int cy = srcSize.height * fx.center.y / 100;
+			int rx = fx.radius.width;
+			int ry = fx.radius.height;
+			if (rx <= 0) rx = max(cx, srcSize.width - 1 - cx);
+			if (ry <= 0) ry = max(cy, srcSize.height - 1 - cy);
+			rx = max(rx, 1);
+			ry = max(ry, 1);
+
+			Color final;
+			for (int y = 0; y < srcSize.height; ++y) {
+				for (int x = 0; x < srcSize.width; ++x) {
+					const double dx = (double) (x - cx) / (double) rx;
+					const double dy = (double) (y - cy) / (double) ry;
+					const double t = sqrt(dx * dx + dy * dy);
+					gradientKeyColor(final, fx.keys, (int) ((t < 1.0 ? t : 1.0) * 10000.0));
+
+					const int i = y * srcSize.width + x;
+					final.a = src[i].a * final.a / 255;
+					reference::blend(dst[i], dst[i], final, fx.blendMode);
+				}
+			}
+		}
+
+		bool apply(const Effect& effect, Color* baseLayer, Color* dst, const Color* src, const Size& srcSize) {
+			if (auto* fx = dynamic_cast<const ColorOverlay*>(&effect)) applyColorOverlay(*fx, dst, src, srcSize);
+			else if (auto* fx = dynamic_cast<const Blur*>(&effect)) blur(dst, src, srcSize, fx->size);
+			else if (auto* fx = dynamic_cast<const Outline*>(&effect)) applyOutline(*fx, baseLayer, src, srcSize);
+			else if (auto* fx = dynamic_cast<const Shadow*>(&effect)) applyShadow(*fx, baseLayer, src, srcSize);
+			else if (auto* fx = dynamic_cast<const InnerShadow*>(&effect)) applyInnerShadow(*fx, dst, src, srcSize);
+			else if (auto* fx = dynamic_cast<const Glow*>(&effect)) applyGlow(*fx, baseLayer, src, srcSize);
+			else if (auto* fx = dynamic_cast<const InnerGlow*>(&effect)) applyInnerGlow(*fx, dst, src, srcSize);
+			else if (auto* fx = dynamic_cast<const Gradient*>(&effect)) applyGradient(*fx, dst, src, srcSize);
+			else if (auto* fx = dynamic_cast<const RadialGradient*>(&effect)) applyRadialGradient(*fx, dst, src, srcSize);
+			else return false;
+			return true;
+		}
+
+		// Apply an effect with its optimized implementation, using the reference buffer protocol
+		static void applyOptimized(const Effect& effect, Color* baseLayer, Color* dst, const Color* src, const Size& srcSize) {
+			if (effect.getAccess() == kEffectAccess_SeparateSource) {
+				std::vector<Color> img(src, src + srcSize.width * srcSize.height);
+				effect.apply(baseLayer, dst, img.data(), srcSize);
+			}
+			else {
+				effect.apply(baseLayer, dst, dst, srcSize);
+			}
+		}
+
+		// Source of a layer in RGBA
+		static std::vector<Color> sourceImage(const Layer& layer) {
+			const int len = layer.size.width * layer.size.height;
+			std::vector<Color> img(len);
+			const unsigned char* src = (const unsigned char*) layer.getSource();
+			for (int i = 0; i < len; ++i) {
+				switch (layer.getFormat()) {
+				case kPixelFormat_RGBA:
+					img[i] = { src[i * 4 + 0], src[i * 4 + 1], src[i * 4 + 2], src[i * 4 + 3] };
+					break;
+				case kPixelFormat_BGRA:
+					img[i] = { src[i * 4 + 2], src[i * 4 + 1], src[i * 4 + 0], src[i * 4 + 3] };
+					break;
+				case kPixelFormat_A8:
+					img[i] = layer.fill;
+					img[i].a = (unsigned char) (src[i] * layer.fill.a / 255);
+					break;
+				}
+			}
+			return img;
+		}
+
+		static void swizzle(std::vector<Color>& img) {
+			for (auto& px : img) std::swap(px.r, px.b);
+		}
+
+		// Reference bake. When resync is set, approximate effects use their optimized
+		// implementation so their error doesn't spread to the following effects.
+		static void bakeImage(const Layer& layer, std::vector<Color> img, const Size& size, Color* dst, const bool resync) {
+			const int len = size.width * size.height;
+			std::vector<Color> imgSrc(len);
+
+			for (auto* pEffect : layer.getEffects()) {
+				imgSrc = img;
+				if (resync && isApproximate(*pEffect)) applyOptimized(*pEffect, dst, img.data(), imgSrc.data(), size);
+				else apply(*pEffect, dst, img.data(), imgSrc.data(), size);
+			}
+
+			for (int i = 0; i < len; ++i) {
+				reference::blend(dst[i], dst[i], img[i], layer.blendMode);
+			}
+		}
+
+		static void bakeLayer(const Layer& layer, Color* dst, const bool resync) {
+			bakeImage(layer, sourceImage(layer), layer.size, dst, resync);
+		}
+
+		// Source of a layer with a transparent margin of extent pixels, like an atlas slot
+		static std::vector<Color> paddedImage(const Layer& layer, const Extent& extent, Size& paddedSize) {
+			paddedSize.width = layer.size.width + extent.left + extent.right;
+			paddedSize.height = layer.size.height + extent.top + extent.bottom;
+			Color transparent = { 0, 0, 0, 0 };
+			if (layer.getFormat() == kPixelFormat_A8) {
+				transparent = layer.fill;
+				transparent.a = 0;
+			}
+			std::vector<Color> img(paddedSize.width * paddedSize.height, transparent);
+			const std::vector<Color> source = sourceImage(layer);
+			for (int y = 0; y < layer.size.height; ++y) {
+				std::copy(source.begin() + y * layer.size.width, source.begin() + (y + 1) * layer.size.width,
+					img.begin() + (y + extent.top) * paddedSize.width + extent.left);
+			}
+			return img;
+		}
+
+		void bake(const Layer& layer, Color* dst) {
+			bakeLayer(layer, dst, false);
+		}
+
+		bool isApproximate(const Effect& effect) {
+			return dynamic_cast<const RadialGradient*>(&effect) != NULL;
+		}
+
+		Report compare(const Color* a, const Color* b, const Size& size, const int tolerance) {
+			Report report = { { 0, 0, 0, 0 }, 0, { -1, -1 } };
+			for (int i = 0; i < size.width * size.height; ++i) {
+				const int errors[4] = {
+					abs(a[i].r - b[i].r),
+					abs(a[i].g - b[i].g),
+					abs(a[i].b - b[i].b),
+					abs(a[i].a - b[i].a) };
+				bool mismatch = false;
+				for (int c = 0; c < 4; ++c) {
+					report.maxError[c] = max(report.maxError[c], errors[c]);
+					mismatch |= errors[c] > tolerance;
+				}
+				if (mismatch) {
+					if (!report.mismatches) report.firstMismatch = { i % size.width, i / size.width };
+					++report.mismatches;
+				}
+			}
+			return report;
+		}
+
+		static const char* effectName(const Effect& effect) {
+			if (dynamic_cast<const ColorOverlay*>(&effect)) return "ColorOverlay";
+			if (dynamic_cast<const Blur*>(&effect)) return "Blur";
+			if (dynamic_cast<const Outline*>(&effect)) return "Outline";
+			if (dynamic_cast<const Shadow*>(&effect)) return "Shadow";
+			if (dynamic_cast<const InnerShadow*>(&effect)) return "InnerShadow";
+			if (dynamic_cast<const Glow*>(&effect)) return "Glow";
+			if (dynamic_cast<const InnerGlow*>(&effect)) return "InnerGlow";
+			if (dynamic_cast<const Gradient*>(&effect)) return "Gradient";
+			if (dynamic_cast<const RadialGradient*>(&effect)) return "RadialGradient";
+			return "Unknown";
+		}
+
+		static void logReport(const char* name, const Layer& layer, const Report& report, const int tolerance, const DifferentialOptions& options) {
+			if (!options.log) return;
+			fprintf(options.log, "FAIL %s %dx%d threads %u: %d mismatches, first at (%d,%d), max error %d %d %d %d (tolerance %d), effects:",
+				name, layer.size.width, layer.size.height, getThreadCount(), report.mismatches,
+				report.firstMismatch.x, report.firstMismatch.y,
+				report.maxError[0], report.maxError[1], report.maxError[2], report.maxError[3], tolerance);
+			for (auto* pEffect : layer.getEffects()) fprintf(options.log, " %s", effectName(*pEffect));
+			fprintf(options.log, "\n");
+		}
+
+		// Bake a layer with both implementations and every thread count, then report.
+		// Approximate effects are checked on their own against their tolerance, then
+		// the stack is checked exactly with their optimized output.
+		static bool check(const char* name, const Layer& layer, const Color* base, const DifferentialOptions& options, const ePixelFormat dstFormat = kPixelFormat_RGBA) {
+			const int len = layer.size.width * layer.size.height;
+			const std::vector<Color> source = sourceImage(layer);
+			std::vector<Color> dstBase(base, base + len);
+			if (dstFormat == kPixelFormat_BGRA) swizzle(dstBase);
+
+			std::vector<Color> expected(base, base + len);
+			bakeLayer(layer, expected.data(), true);
+
+			bool passed = true;
+			const unsigned int prevThreadCount = getThreadCount();
+			for (auto threadCount : options.threadCounts) {
+				setThreadCount(threadCount);
+
+				for (auto* pEffect : layer.getEffects()) {
+					if (!isApproximate(*pEffect)) continue;
+
+					// Hue, Saturation, Color and Luminosity turn small errors of near grays
+					// into large ones, gradients using them are checked in normal mode
+					RadialGradient normal(*static_cast<const RadialGradient*>(pEffect));
+					const bool nonSeparableMode = normal.blendMode >= kBlendMode_Hue && normal.blendMode <= kBlendMode_Luminosity;
+					normal.blendMode = kBlendMode_Normal;
+					const Effect& effect = nonSeparableMode ? normal : *pEffect;
+					std::vector<Color> expectedBase(base, base + len), resultBase(base, base + len);
+					std::vector<Color> expectedImg(source), resultImg(source);
+					apply(effect, expectedBase.data(), expectedImg.data(), source.data(), layer.size);
+					applyOptimized(effect, resultBase.data(), resultImg.data(), source.data(), layer.size);
+
+					Report report = compare(resultImg.data(), expectedImg.data(), layer.size, options.approximateTolerance);
+					if (!report.mismatches) report = compare(resultBase.data(), expectedBase.data(), layer.size, options.approximateTolerance);
+					if (report.mismatches * 1000 > len * options.approximateMismatches) {
+						passed = false;
+						logReport(name, layer, report, options.approximateTolerance, options);
+					}
+				}
+
+				std::vector<Color> result(dstBase);
+				layer.bake(result.data(), dstFormat);
+				if (dstFormat == kPixelFormat_BGRA) swizzle(result);
+				Report report = compare(result.data(), expected.data(), layer.size, options.tolerance);
+				if (report.mismatches) {
+					passed = false;
+					logReport(name, layer, report, options.tolerance, options);
+				}
+
+				// Resumable bake, with a budget small enough to stop after every chunk
+				std::vector<Color> stepped(dstBase);
+				BakeJob job(layer, stepped.data(), dstFormat);
+				while (!job.step(0.f));
+				if (dstFormat == kPixelFormat_BGRA) swizzle(stepped);
+				report = compare(stepped.data(), expected.data(), layer.size, options.tolerance);
+				if (report.mismatches) {
+					passed = false;
+					logReport(name, layer, report, options.tolerance, options);
+				}
+			}
+			setThreadCount(prevThreadCount);
+			return passed;
+		}
+
+		static const eBlendMode g_blendModes[] = { kBlendMode_Normal, kBlendMode_Multiply, kBlendMode_Screen,
+			kBlendMode_Hue, kBlendMode_Saturation, kBlendMode_Color, kBlendMode_Luminosity, kBlendMode_DarkerColor, kBlendMode_LighterColor };
+		static const int g_blendModeCount = sizeof(g_blendModes) / sizeof(eBlendMode);
+
+		class Random {
+		public:
+			Random(unsigned int seed) : engine(seed) {}
+			int range(int from, int to) { return from + (int) (engine() % (unsigned int) (to - from + 1)); }
+			unsigned char byte() { return (unsigned char) range(0, 255); }
+			Color color() { Color c = { byte(), byte(), byte(), byte() }; return c; }
+			eBlendMode blendMode() { return g_blendModes[range(0, g_blendModeCount - 1)]; }
+		private:
+			std::mt19937 engine;
+		};
+
+		// Transparent image with a few shapes and some noise, like sprites and glyphs
+		static void randomImage(Random& rnd, Color* img, const Size& size) {
+			memset(img, 0, sizeof(Color) * size.width * size.height);
+			const int shapeCount = rnd.range(1, 4);
+			for (int s = 0; s < shapeCount; ++s) {
+				const Color color = rnd.color();
+				const int cx = rnd.range(0, size.width - 1);
+				const int cy = rnd.range(0, size.height - 1);
+				const int r = rnd.range(1, max(size.width, size.height) / 2);
+				const bool circle = rnd.range(0, 1) == 0;
+				for (int y = 0; y < size.height; ++y) {
+					for (int x = 0; x < size.width; ++x) {
+						const int dx = x - cx;
+						const int dy = y - cy;
+						if (circle ? dx * dx + dy * dy <= r * r : abs(dx) <= r && abs(dy) <= r / 2) {
+							img[y * size.width + x] = color;
+						}
+					}
+				}
+			}
+			const int noiseCount = rnd.range(0, size.width * size.height / 8);
+			for (int n = 0; n < noiseCount; ++n) {
+				img[rnd.range(0, size.width * size.height - 1)] = rnd.color();
+			}
+		}
+
+		static std::vector<GradientKey> randomKeys(Random& rnd) {
+			std::vector<GradientKey> keys(rnd.range(1, 4));
+			int percent = 0;
+			for (auto& key : keys) {
+				percent = rnd.range(percent, 100);
+				key.color = rnd.color();
+				key.percent = percent;
+			}
+			return keys;
+		}
+
+		static void addRandomEffect(Random& rnd, Layer& layer, const DifferentialOptions& options) {
+			const Offset offset = { rnd.range(-options.maxOffset, options.maxOffset), rnd.range(-options.maxOffset, options.maxOffset) };
+			const int radius = rnd.range(0, options.maxRadius);
+			switch (rnd.range(0, 8)) {
+			case 0: layer.addEffect(ColorOverlay(rnd.color(), rnd.blendMode())); break;
+			case 1: layer.addEffect(Blur(radius)); break;
+			case 2: layer.addEffect(Outline(rnd.color(), radius, rnd.blendMode())); break;
+			case 3: layer.addEffect(Shadow(rnd.color(), offset, radius, rnd.blendMode())); break;
+			case 4: layer.addEffect(InnerShadow(rnd.color(), offset, radius, rnd.blendMode())); break;
+			case 5: layer.addEffect(Glow(rnd.color(), radius, rnd.blendMode())); break;
+			case 6: layer.addEffect(InnerGlow(rnd.color(), radius, rnd.blendMode())); break;
+			case 7: layer.addEffect(Gradient(randomKeys(rnd), rnd.range(-360, 720), rnd.blendMode())); break;
+			case 8: {
+				const Offset center = { rnd.range(0, 100), rnd.range(0, 100) };
+				const Size radius = { rnd.range(0, options.maxImageSize), rnd.range(0, options.maxImageSize) };
+				layer.addEffect(RadialGradient(randomKeys(rnd), center, radius, rnd.blendMode()));
+				break;
+			}
+			}
+		}
+
+		// New effect of the same type as effect, with random parameters
+		static Effect* randomEffectLike(Random& rnd, const Effect& effect, const DifferentialOptions& options) {
+			const Offset offset = { rnd.range(-options.maxOffset, options.maxOffset), rnd.range(-options.maxOffset, options.maxOffset) };
+			const int radius = rnd.range(0, options.maxRadius);
+			if (auto* p = dynamic_cast<const ColorOverlay*>(&effect)) return new ColorOverlay(rnd.color(), p->blendMode);
+			if (dynamic_cast<const Blur*>(&effect)) return new Blur(radius);
+			if (auto* p = dynamic_cast<const Outline*>(&effect)) return new Outline(rnd.color(), radius, p->blendMode);
+			if (auto* p = dynamic_cast<const Shadow*>(&effect)) return new Shadow(rnd.color(), offset, radius, p->blendMode);
+			if (auto* p = dynamic_cast<const InnerShadow*>(&effect)) return new InnerShadow(rnd.color(), offset, radius, p->blendMode);
+			if (auto* p = dynamic_cast<const Glow*>(&effect)) return new Glow(rnd.color(), radius, p->blendMode);
+			if (auto* p = dynamic_cast<const InnerGlow*>(&effect)) return new InnerGlow(rnd.color(), radius, p->blendMode);
+			if (auto* p = dynamic_cast<const Gradient*>(&effect)) return new Gradient(randomKeys(rnd), rnd.range(-360, 720), p->blendMode);
+			if (auto* p = dynamic_cast<const RadialGradient*>(&effect)) {
+				const Offset center = { rnd.range(0, 100), rnd.range(0, 100) };
+				const Size radius = { rnd.range(0, options.maxImageSize), rnd.range(0, options.maxImageSize) };
+				return new RadialGradient(randomKeys(rnd), center, radius, p->blendMode);
+			}
+			return NULL;
+		}
+
+		// Bake an animation and compare every frame with the reference bake of its
+		// interpolated effects
+		static bool checkAnimation(const char* name, const Layer& layer, const Animation& animation, const int frameCount, const Color* base, const DifferentialOptions& options, const ePixelFormat dstFormat) {
+			const int len = layer.size.width * layer.size.height;
+			std::vector<Color> dstBase(base, base + len);
+			if (dstFormat == kPixelFormat_BGRA) swizzle(dstBase);
+
+			std::vector<std::vector<Color>> expected(frameCount);
+			for (int f = 0; f < frameCount; ++f) {
+				std::unique_ptr<Layer> frame(animation.createFrame(f));
+				expected[f].assign(base, base + len);
+				bakeLayer(*frame, expected[f].data(), true);
+			}
+
+			bool passed = true;
+			const unsigned int prevThreadCount = getThreadCount();
+			for (auto threadCount : options.threadCounts) {
+				setThreadCount(threadCount);
+				std::vector<Color> result;
+				for (int f = 0; f < frameCount; ++f) result.insert(result.end(), dstBase.begin(), dstBase.end());
+				animation.bake(result.data(), frameCount, dstFormat);
+				if (dstFormat == kPixelFormat_BGRA) swizzle(result);
+
+				for (int f = 0; f < frameCount; ++f) {
+					const Report report = compare(result.data() + f * len, expected[f].data(), layer.size, options.tolerance);
+					if (report.mismatches) {
+						passed = false;
+						if (options.log) fprintf(options.log, "frame %d of %d, ", f, frameCount);
+						logReport(name, layer, report, options.tolerance, options);
+						break;
+					}
+				}
+			}
+			setThreadCount(prevThreadCount);
+			return passed;
+		}
+
+		// Check that nothing is drawn past the extent of a layer, then pack it twice
+		// in an atlas and compare every slot with the reference bake of the padded layer
+		static bool checkAtlas(const char* name, const Layer& layer, Random& rnd, const DifferentialOptions& options, const ePixelFormat dstFormat) {
+			bool passed = true;
+			const Extent extent = layer.getExtent();
+
+			Extent margin = { extent.left + 2, extent.top + 2, extent.right + 2, extent.bottom + 2 };
+			Size marginSize;
+			std::vector<Color> grown(paddedImage(layer, margin, marginSize).size(), Color());
+			bakeImage(layer, paddedImage(layer, margin, marginSize), marginSize, grown.data(), true);
+			for (int y = 0; y < marginSize.height && passed; ++y) {
+				for (int x = 0; x < marginSize.width; ++x) {
+					const bool inside = x >= 2 && y >= 2 && x < marginSize.width - 2 && y < marginSize.height - 2;
+					if (!inside && grown[y * marginSize.width + x].a) {
+						passed = false;
+						if (options.log) fprintf(options.log, "FAIL %s: drawn past the extent at (%d,%d)\n", name, x - margin.left, y - margin.top);
+						break;
+					}
+				}
+			}
+
+			Size slotSize;
+			const std::vector<Color> padded = paddedImage(layer, extent, slotSize);
+
+			// Padded by its extent, the layer bakes the same as with a larger margin.
+			// Gradients are sized from the image, they can't. Transparent pixels
+			// keep colors, bake on an opaque base to only compare what shows
+			bool sizedFromImage = false;
+			for (auto* pEffect : layer.getEffects()) {
+				sizedFromImage |= dynamic_cast<const Gradient*>(pEffect) || dynamic_cast<const RadialGradient*>(pEffect);
+			}
+			if (!sizedFromImage) {
+				const Color opaque = { 128, 128, 128, 255 };
+				std::vector<Color> slotImg(padded.size(), opaque);
+				bakeImage(layer, padded, slotSize, slotImg.data(), true);
+				std::vector<Color> marginImg(grown.size(), opaque);
+				bakeImage(layer, paddedImage(layer, margin, marginSize), marginSize, marginImg.data(), true);
+				for (int y = 0; y < slotSize.height && passed; ++y) {
+					for (int x = 0; x < slotSize.width; ++x) {
+						const Color& a = slotImg[y * slotSize.width + x];
+						const Color& b = marginImg[(y + 2) * marginSize.width + x + 2];
+						if (a.r != b.r || a.g != b.g || a.b != b.b || a.a != b.a) {
+							passed = false;
+							if (options.log) {
+								fprintf(options.log, "FAIL %s: cut by the extent at (%d,%d), effects:", name, x - extent.left, y - extent.top);
+								for (auto* pEffect : layer.getEffects()) fprintf(options.log, " %s", effectName(*pEffect));
+								fprintf(options.log, "\n");
+							}
+							break;
+						}
+					}
+				}
+			}
+
+			const int padding = rnd.range(0, 2);
+			const Size size = { slotSize.width * 2 + padding + rnd.range(0, 3), slotSize.height + rnd.range(0, 3) };
+			std::vector<Color> base(size.width * size.height);
+			randomImage(rnd, base.data(), size);
+
+			Atlas atlas(size, padding);
+			const int first = atlas.add(layer);
+			const int second = atlas.add(layer);
+			if (!atlas.pack()) {
+				if (options.log) fprintf(options.log, "FAIL %s: atlas doesn't fit\n", name);
+				return false;
+			}
+
+			std::vector<Color> expected(base);
+			for (auto index : { first, second }) {
+				const Rect slot = atlas.getSlot(index);
+				const Offset origin = atlas.getOrigin(index);
+				if (slot.width != slotSize.width || slot.height != slotSize.height ||
+					origin.x != slot.x + extent.left || origin.y != slot.y + extent.top) {
+					if (options.log) fprintf(options.log, "FAIL %s: wrong slot %d\n", name, index);
+					return false;
+				}
+				std::vector<Color> slotImg(slotSize.width * slotSize.height);
+				for (int y = 0; y < slot.height; ++y) {
+					std::copy(expected.begin() + (slot.y + y) * size.width + slot.x, expected.begin() + (slot.y + y) * size.width + slot.x + slot.width,
+						slotImg.begin() + y * slot.width);
+				}
+				bakeImage(layer, padded, slotSize, slotImg.data(), true);
+				for (int y = 0; y < slot.height; ++y) {
+					std::copy(slotImg.begin() + y * slot.width, slotImg.begin() + (y + 1) * slot.width,
+						expected.begin() + (slot.y + y) * size.width + slot.x);
+				}
+			}
+
+			std::vector<Color> result(base);
+			if (dstFormat == kPixelFormat_BGRA) swizzle(result);
+			atlas.bake(result.data(), dstFormat);
+			if (dstFormat == kPixelFormat_BGRA) swizzle(result);
+			const Report report = compare(result.data(), expected.data(), size, options.tolerance);
+			if (report.mismatches) {
+				passed = false;
+				logReport(name, layer, report, options.tolerance, options);
+			}
+			return passed;
+		}
+
+		bool runDifferential(const DifferentialOptions& options) {
+			Random rnd(options.seed);
+			bool passed = true;
+			int failures = 0;
+
+			// Blend modes on their own, the non separable ones from the spec
+			g_resyncBlendModes = false;
+			for (int i = 0; i < 100000; ++i) {
+				const Color dst = rnd.color();
+				const Color src = rnd.color();
+				const eBlendMode blendMode = rnd.blendMode();
+				const bool rounded = blendMode >= kBlendMode_Hue && blendMode <= kBlendMode_Luminosity;
+				Color expected, result;
+				reference::blend(expected, dst, src, blendMode);
+				dle::blend(result, dst, src, blendMode);
+				const Report report = compare(&result, &expected, { 1, 1 }, rounded ? max(options.tolerance, 1) : options.tolerance);
+				if (report.mismatches) {
+					passed = false;
+					++failures;
+					if (options.log) {
+						fprintf(options.log, "FAIL blend mode %d: dst %d %d %d %d src %d %d %d %d\n", (int) blendMode,
+							dst.r, dst.g, dst.b, dst.a, src.r, src.g, src.b, src.a);
+					}
+				}
+			}
+			g_resyncBlendModes = true;
+
+			// Rows, with a source per pixel and with a single source color
+			for (int m = 0; m < g_blendModeCount; ++m) {
+				for (int srcStep = 0; srcStep < 2; ++srcStep) {
+					const Size size = { rnd.range(1, 1500), 1 };
+					std::vector<Color> dst(size.width), src(size.width), expected(size.width), result(size.width);
+					randomImage(rnd, dst.data(), size);
+					randomImage(rnd, src.data(), size);
+					for (int i = 0; i < size.width; ++i) dle::blend(expected[i], dst[i], src[i * srcStep], g_blendModes[m]);
+					dle::blendRow(result.data(), dst.data(), src.data(), srcStep, size.width, g_blendModes[m]);
+					const Report report = compare(result.data(), expected.data(), size, 0);
+					if (report.mismatches) {
+						passed = false;
+						++failures;
+						if (options.log) {
+							fprintf(options.log, "FAIL blend row, mode %d, source step %d: pixel %d of %d\n", (int) g_blendModes[m], srcStep,
+								report.firstMismatch.x, size.width);
+						}
+					}
+				}
+			}
+
+			// The effects need their radius and offsets to fit in the image
+			const int minSize = max(options.maxRadius * 2 + 2, options.maxOffset + 1);
+			const int maxSize = max(options.maxImageSize, minSize);
+			for (int i = 0; i < options.iterations; ++i) {
+				const Size size = { rnd.range(minSize, maxSize), rnd.range(minSize, maxSize) };
+				std::vector<Color> img(size.width * size.height);
+				std::vector<Color> base(size.width * size.height);
+				randomImage(rnd, img.data(), size);
+				randomImage(rnd, base.data(), size);
+
+				// Sources and destinations in every format
+				const ePixelFormat format = (ePixelFormat) rnd.range(kPixelFormat_RGBA, kPixelFormat_A8);
+				const ePixelFormat dstFormat = (ePixelFormat) rnd.range(kPixelFormat_RGBA, kPixelFormat_BGRA);
+				std::vector<unsigned char> src(size.width * size.height * 4);
+				for (int p = 0; p < size.width * size.height; ++p) {
+					const Color& px = img[p];
+					if (format == kPixelFormat_A8) src[p] = px.a;
+					else if (format == kPixelFormat_BGRA) { src[p * 4] = px.b; src[p * 4 + 1] = px.g; src[p * 4 + 2] = px.r; src[p * 4 + 3] = px.a; }
+					else { src[p * 4] = px.r; src[p * 4 + 1] = px.g; src[p * 4 + 2] = px.b; src[p * 4 + 3] = px.a; }
+				}
+
+				Layer layer(src.data(), size, format, rnd.color(), rnd.blendMode());
+				const int effectCount = rnd.range(1, options.maxEffects);
+				for (int e = 0; e < effectCount; ++e) {
+					addRandomEffect(rnd, layer, options);
+				}
+
+				char name[32];
+				sprintf(name, "case %d", i);
+				if (!check(name, layer, base.data(), options, dstFormat)) {
+					passed = false;
+					++failures;
+				}
+
+				// Animate some of the stacks. Separate random numbers keep the cases of a seed the same
+				if (i % 8 == 0) {
+					Random animRnd(options.seed * 7919u + (unsigned int) i);
+					Animation animation(layer);
+					const int keyframeCount = animRnd.range(1, 2);
+					for (int k = 0; k < keyframeCount; ++k) {
+						std::vector<Effect*> effects;
+						for (auto* pEffect : layer.getEffects()) effects.push_back(randomEffectLike(animRnd, *pEffect, options));
+						animation.addKeyframe(animRnd.range(1, 6), effects);
+					}
+					sprintf(name, "animation %d", i);
+					if (!checkAnimation(name, layer, animation, animRnd.range(1, 8), base.data(), options, dstFormat)) {
+						passed = false;
+						++failures;
+					}
+				}
+
+				// Pack some of the stacks in an atlas
+				if (i % 8 == 4) {
+					Random atlasRnd(options.seed * 7919u + (unsigned int) i);
+					sprintf(name, "atlas %d", i);
+					if (!checkAtlas(name, layer, atlasRnd, options, dstFormat)) {
+						passed = false;
+						++failures;
+					}
+				}
+			}
+
+			if (options.log) {
+				fprintf(options.log, "%s: %d failures, %d cases, seed %u\n", passed ? "PASS" : "FAIL", failures, options.iterations, options.seed);
+			}
+			return passed;
+		}
+
+		// White disc with its antialiased coverage in alpha, 16x16 samples per pixel.
+		// Positions are in pixels of an image scaled by scale
+		static void disc(Color* dst, const Size& size, const float cx, const float cy, const float radius, const float scale) {
+			for (int y = 0; y < size.height; ++y) {
+				for (int x = 0; x < size.width; ++x, ++dst) {
+					int covered = 0;
+					for (int sy = 0; sy < 16; ++sy) {
+						for (int sx = 0; sx < 16; ++sx) {
+							const float dx = ((float) x + ((float) sx + .5f) / 16.f) / scale - cx;
+							const float dy = ((float) y + ((float) sy + .5f) / 16.f) / scale - cy;
+							if (dx * dx + dy * dy < radius * radius) ++covered;
+						}
+					}
+					*dst = { 255, 255, 255, (unsigned char) min(covered, 255) };
+				}
+			}
+		}
+
+		bool runBlendModes(const DifferentialOptions& options) {
+			static const eBlendMode modes[] = { kBlendMode_Hue, kBlendMode_Saturation, kBlendMode_Color,
+				kBlendMode_Luminosity, kBlendMode_DarkerColor, kBlendMode_LighterColor };
+			Random rnd(options.seed);
+			bool passed = true;
+			for (auto blendMode : modes) {
+				int worst = 0;
+				Color worstDst = { 0, 0, 0, 0 }, worstSrc = { 0, 0, 0, 0 };
+				for (int i = 0; i < 1000000; ++i) {
+					// Grays and colors with two equal channels are where the spec branches
+					Color dst = rnd.color(), src = rnd.color();
+					if (i % 8 == 1) dst.g = dst.b = dst.r;
+					if (i % 8 == 2) src.g = src.b = src.r;
+					if (i % 8 == 3) src.b = src.g;
+					dst.a = src.a = 255;
+
+					// Opaque colors give the blended color as is
+					Color result;
+					dle::blend(result, dst, src, blendMode);
+					const Color expected = specBlend(dst, src, blendMode);
+					const int error = max(abs(result.r - expected.r), max(abs(result.g - expected.g), abs(result.b - expected.b)));
+					if (error > worst) {
+						worst = error;
+						worstDst = dst;
+						worstSrc = src;
+					}
+				}
+				if (worst > 1) {
+					passed = false;
+					if (options.log) {
+						fprintf(options.log, "FAIL blend mode %d off the spec by %d: dst %d %d %d src %d %d %d\n", (int) blendMode, worst,
+							worstDst.r, worstDst.g, worstDst.b, worstSrc.r, worstSrc.g, worstSrc.b);
+					}
+				}
+			}
+
+			if (options.log) fprintf(options.log, "%s: blend modes\n", passed ? "PASS" : "FAIL");
+			return passed;
+		}
+
+		bool runDistanceField(const DifferentialOptions& options) {
+			// The field is quantized to 8 bits and interpolated between its texels:
+			// allow 3/16 of a source pixel on the edge position, which covers more
+			// of the ramp as the render scales up
+			static const int maxErrorPerScale = 48;
+
+			const Size size = { 96, 80 };
+			std::vector<Color> src(size.width * size.height);
+			disc(src.data(), size, 41.3f, 38.7f, 23.6f, 1.f);
+
+			struct Case { int downsample; int scale; };
+			const Case cases[] = { { 1, 1 }, { 2, 1 }, { 4, 1 }, { 2, 2 }, { 4, 3 } };
+			bool passed = true;
+			for (auto& c : cases) {
+				const DistanceField field = bakeDistanceField(src.data(), size, 8, c.downsample);
+
+				// A direct bake of the disc at the render size
+				const Size dstSize = { size.width * c.scale, size.height * c.scale };
+				std::vector<Color> expected(dstSize.width * dstSize.height);
+				disc(expected.data(), dstSize, 41.3f, 38.7f, 23.6f, (float) c.scale);
+
+				// Over opaque black, the white fill leaves its coverage in the color
+				std::vector<Color> result(dstSize.width * dstSize.height, Color{ 0, 0, 0, 255 });
+				renderDistanceField(result.data(), dstSize, field);
+
+				const int maxError = min(maxErrorPerScale * c.scale, 255);
+				int worst = 0;
+				for (size_t i = 0; i < result.size(); ++i) {
+					worst = max(worst, abs((int) result[i].r - (int) expected[i].a));
+				}
+				if (worst > maxError) {
+					passed = false;
+					if (options.log) {
+						fprintf(options.log, "FAIL distance field, downsample %d, scale %d: alpha off by %d, tolerance %d\n", c.downsample, c.scale, worst, maxError);
+					}
+				}
+			}
+
+			if (options.log) fprintf(options.log, "%s: distance field\n", passed ? "PASS" : "FAIL");
+			return passed;
+		}
+
+		bool runPreview(const DifferentialOptions& options) {
+			// Averaging the pixels of a full bake and baking averaged pixels differ
+			// where effects aren't linear: allow an average error per channel, and a
+			// few far pixels. Effect sizes and offsets are multiples of the factors,
+			// so they scale without rounding
+			static const int maxMeanError = 3;
+			static const int farError = 48;
+			static const int maxFarPixels = 5;	// Per thousand
+
+			// Colored discs over a checker
+			const Size size = { 128, 96 };
+			const int len = size.width * size.height;
+			std::vector<Color> src(len), base(len), second(len);
+			disc(src.data(), size, 52.4f, 45.1f, 29.3f, 1.f);
+			disc(second.data(), size, 98.7f, 30.2f, 14.6f, 1.f);
+			for (int y = 0; y < size.height; ++y) {
+				for (int x = 0; x < size.width; ++x) {
+					Color& px = src[y * size.width + x];
+					px = { (unsigned char) (x * 2), (unsigned char) (255 - y * 2), 180, (unsigned char) max(px.a, second[y * size.width + x].a) };
+					base[y * size.width + x] = ((x / 8 + y / 8) & 1) ? Color{ 200, 200, 200, 255 } : Color{ 90, 90, 90, 255 };
+				}
+			}
+
+			const std::vector<GradientKey> keys = { { { 255, 200, 0, 255 }, 0 }, { { 255, 0, 0, 255 }, 60 }, { { 80, 0, 120, 255 }, 100 } };
+			std::vector<std::unique_ptr<Layer>> layers;
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, ColorOverlay({ 40, 160, 255, 255 }, kBlendMode_Hue)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, Blur(4)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, Outline({ 0, 0, 0, 255 }, 4)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, Shadow({ 0, 0, 0, 255 }, { 6, 8 }, 6)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, InnerShadow({ 0, 0, 0, 245 }, { 4, 4 }, 4)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, Glow({ 255, 255, 190, 200 }, 8)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, InnerGlow({ 255, 255, 190, 200 }, 8)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, Gradient(keys, 30)));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Normal, RadialGradient(keys, { 40, 50 }, { 48, 32 })));
+			layers.emplace_back(new Layer(src.data(), size, kBlendMode_Multiply, Shadow({ 0, 0, 0, 255 }, { 4, 8 }, 8), Outline({ 0, 0, 0, 245 }, 4),
+				InnerGlow({ 255, 255, 190, 150 }, 8), Glow({ 255, 255, 190, 150 }, 4)));
+
+			bool passed = true;
+			int failures = 0;
+			const int factors[] = { 2, 4 };
+			for (size_t l = 0; l < layers.size(); ++l) {
+				const Layer& layer = *layers[l];
+				for (int factor : factors) {
+					// The full bake, downscaled
+					std::vector<Color> full(base);
+					layer.bake(full.data());
+					const Size smallSize = previewSize(size, factor);
+					std::vector<Color> expected(smallSize.width * smallSize.height);
+					downscale(expected.data(), full.data(), size, factor);
+
+					std::vector<Color> preview(smallSize.width * smallSize.height);
+					downscale(preview.data(), base.data(), size, factor);
+					layer.bakePreview(preview.data(), factor);
+
+					int errorSum = 0;
+					int farPixels = 0;
+					for (size_t i = 0; i < preview.size(); ++i) {
+						int pixelError = 0;
+						for (int c = 0; c < 4; ++c) {
+							const int error = abs((int) (&preview[i].r)[c] - (int) (&expected[i].r)[c]);
+							errorSum += error;
+							pixelError = max(pixelError, error);
+						}
+						if (pixelError > farError) ++farPixels;
+					}
+					const int meanError = (errorSum + (int) preview.size() * 2) / ((int) preview.size() * 4);
+					const int farPerThousand = farPixels * 1000 / (int) preview.size();
+					if (meanError > maxMeanError || farPerThousand > maxFarPixels) {
+						passed = false;
+						++failures;
+						if (options.log) {
+							fprintf(options.log, "FAIL preview of layer %d, factor %d: mean error %d, tolerance %d, %d per thousand over %d, tolerance %d\n",
+								(int) l, factor, meanError, maxMeanError, farPerThousand, farError, maxFarPixels);
+						}
+					}
+				}
+
+				// The progressive bake shows the same preview, then refines to the full bake
+				const Size smallSize = previewSize(size, 2);
+				std::vector<Color> preview(smallSize.width * smallSize.height);
+				downscale(preview.data(), base.data(), size, 2);
+				std::vector<Color> expectedPreview(preview);
+				layer.bakePreview(expectedPreview.data(), 2);
+				std::vector<Color> full(base), expected(base);
+				layer.bake(expected.data());
+				const BakeHandle handle = layer.bakeProgressive(preview.data(), 2, full.data());
+				if (memcmp(preview.data(), expectedPreview.data(), sizeof(Color) * preview.size())) {
+					passed = false;
+					++failures;
+					if (options.log) fprintf(options.log, "FAIL progressive preview of layer %d differs from bakePreview\n", (int) l);
+				}
+				if (!handle.wait() || memcmp(full.data(), expected.data(), sizeof(Color) * len)) {
+					passed = false;
+					++failures;
+					if (options.log) fprintf(options.log, "FAIL progressive refine of layer %d differs from bake\n", (int) l);
+				}
+			}
+
+			if (options.log) fprintf(options.log, "%s: preview, %d failures\n", passed ? "PASS" : "FAIL", failures);
+			return passed;
+		}
+
+		unsigned int hash(const void* data, const int bytes) {
+			// FNV-1a
+			const unsigned char* p = (const unsigned char*) data;
+			unsigned int h = 2166136261u;
+			for (int i = 0; i < bytes; ++i) {
+				h ^= p[i];
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		bool runGolden(const void* in_src, const Size& srcSize, const DifferentialOptions& options, std::vector<unsigned int>* hashes) {
+			const Color* src = (const Color*) in_src;
+			const std::vector<GradientKey> keys = { { { 255, 200, 0, 255 }, 0 }, { { 255, 0, 0, 255 }, 60 }, { { 80, 0, 120, 255 }, 100 } };
+			std::vector<Color> base(srcSize.width * srcSize.height);
+			for (int y = 0; y < srcSize.height; ++y) {
+				for (int x = 0; x < srcSize.width; ++x) {
+					const Color checker = ((x / 16 + y / 16) & 1) ? Color{ 200, 200, 200, 255 } : Color{ 90, 90, 90, 255 };
+					base[y * srcSize.width + x] = checker;
+				}
+			}
+
+			// Check a stack against the reference, then keep the hash of its bake
+			auto golden = [&](const char* name, const Layer& layer, const ePixelFormat dstFormat) {
+				const bool result = check(name, layer, base.data(), options, dstFormat);
+				if (hashes) {
+					std::vector<Color> baked(base);
+					layer.bake(baked.data(), dstFormat);
+					hashes->push_back(hash(baked.data(), (int) (sizeof(Color) * baked.size())));
+				}
+				return result;
+			};
+
+			bool passed = true;
+			passed &= golden("golden shadow", Layer(src, srcSize, kBlendMode_Normal, Shadow()), kPixelFormat_RGBA);
+			passed &= golden("golden overlay", Layer(src, srcSize, kBlendMode_Normal, ColorOverlay(), Shadow()), kPixelFormat_RGBA);
+			passed &= golden("golden outline", Layer(src, srcSize, kBlendMode_Normal, Outline(), Glow()), kPixelFormat_RGBA);
+			passed &= golden("golden inner", Layer(src, srcSize, kBlendMode_Multiply, InnerShadow(), InnerGlow()), kPixelFormat_RGBA);
+			passed &= golden("golden gradient", Layer(src, srcSize, kBlendMode_Normal, Gradient(keys, 45), Blur(2)), kPixelFormat_RGBA);
+			passed &= golden("golden radial", Layer(src, srcSize, kBlendMode_Screen, RadialGradient(keys, { 40, 60 }), Outline({ 0, 0, 0, 255 }, 4)), kPixelFormat_RGBA);
+			passed &= golden("golden colorize", Layer(src, srcSize, kBlendMode_Color, ColorOverlay({ 40, 160, 255, 255 }, kBlendMode_Hue), Glow({ 255, 120, 0, 200 }, 4, kBlendMode_Luminosity)), kPixelFormat_RGBA);
+			passed &= golden("golden blur", Layer(src, srcSize, kBlendMode_Normal, Blur(3), ColorOverlay({ 0, 128, 255, 255 }, kBlendMode_Screen)), kPixelFormat_RGBA);
+
+			// Glyph style, A8 coverage into a BGRA texture
+			std::vector<unsigned char> coverage(srcSize.width * srcSize.height);
+			for (int i = 0; i < srcSize.width * srcSize.height; ++i) coverage[i] = src[i].a;
+			passed &= golden("golden a8", Layer(coverage.data(), srcSize, kPixelFormat_A8, Color{ 255, 220, 120, 255 }, kBlendMode_Normal, Shadow(), Outline(), Glow()), kPixelFormat_BGRA);
+
+			if (options.log) {
+				fprintf(options.log, "%s: golden %dx%d\n", passed ? "PASS" : "FAIL", srcSize.width, srcSize.height);
+			}
+			return passed;
+		}
+	}
+}
@@ -0,0 +1,150 @@
+#ifndef DLE_REFERENCE_H_INCLUDED
+#define DLE_REFERENCE_H_INCLUDED
+
+#include <stdio.h>
+#include "dle.h"
+
+namespace dle
+{
+	/**
+		Frozen scalar implementation of dle, used to validate the optimized code
+		paths. Everything here is single threaded, allocates freely and follows
+		the original full copy bake protocol. Do not optimize this code, its only
+		job is to be obviously correct.
+	*/
+	namespace reference
+	{
+		/**
+			Reference blend. Same signature as dle::blend
+		*/
+		void blend(Color& out, const Color& dst, const Color& src, const eBlendMode& blendMode);
+
+		/**
+			Reference box blur. Same output as the Blur effect.
+
+			@param dst Destination image. Must not be \a src
+			@param src Source image
+			@param srcSize Size of both images
+			@param size Size of the blur
+		*/
+		void blur(Color* dst, const Color* src, const Size& srcSize, const int size);
+
+		/**
+			Apply an effect with its reference implementation.
+
+			@param baseLayer Underlying image, under the current layer
+			@param dst Destination image. Must be a copy of \a src
+			@param src Source image. Left untouched
+			@param srcSize Size of all images
+			@return false if the effect type is unknown to the reference
+		*/
+		bool apply(const Effect& effect, Color* baseLayer, Color* dst, const Color* src, const Size& srcSize);
+
+		/**
+			Bake a layer with the reference implementation. Same output as Layer::bake
+		*/
+		void bake(const Layer& layer, Color* dst);
+
+		/**
+			Returns true if the optimized version of an effect is allowed to differ
+			from the reference, like RadialGradient which uses a color LUT.
+		*/
+		bool isApproximate(const Effect& effect);
+
+		/**
+			Result of an image comparison
+		*/
+		struct Report {
+			int maxError[4];	/**< Maximum absolute error per channel, in RGBA order */
+			int mismatches;		/**< Number of pixels with at least one channel over the tolerance */
+			Offset firstMismatch;	/**< Position of the first mismatching pixel. {-1,-1} if none */
+		};
+
+		/**
+			Compare two images channel by channel.
+
+			@param tolerance Maximum absolute error allowed per channel
+		*/
+		Report compare(const Color* a, const Color* b, const Size& size, const int tolerance = 0);
+
+		/**
+			Options of the differential runs
+		*/
+		struct DifferentialOptions {
+			unsigned int	seed;					/**< Seed of the random cases. Same seed, same cases */
+			int				iterations;				/**< Number of random cases */
+			int				maxImageSize;			/**< Maximum width and height of the random images */
+			int				maxEffects;				/**< Maximum number of effects per random layer */
+			int				maxRadius;				/**< Maximum blur, outline and glow size */
+			int				maxOffset;				/**< Maximum absolute shadow offset */
+			int				tolerance;				/**< Maximum error per channel of exact code paths */
+			int				approximateTolerance;	/**< Maximum error per channel of approximate effects, checked on their own */
+			int				approximateMismatches;	/**< Pixels per thousand allowed over approximateTolerance. Hard steps between gradient keys can land on either side */
+			std::vector<unsigned int> threadCounts;	/**< Thread counts to run each case with. 0 is the hardware concurrency */
+			FILE*			log;					/**< Where to print the reports. NULL to stay silent */
+
+			DifferentialOptions() :
+				seed(1), iterations(200), maxImageSize(96), maxEffects(4), maxRadius(6), maxOffset(6),
+				tolerance(0), approximateTolerance(4), approximateMismatches(5), threadCounts({ 1, 2, 3, 0 }), log(stdout) {}
+		};
+
+		/**
+			Run random images, effect stacks, blend modes and thread counts through
+			the optimized and the reference implementations, and compare them.
+			Layer::bake, BakeJob, Animation and Atlas are checked, with every
+			source and destination pixel format.
+
+			@return true if every case is within tolerance
+		*/
+		bool runDifferential(const DifferentialOptions& options = DifferentialOptions());
+
+		/**
+			Run a fixed set of effect stacks on an image through the optimized and
+			the reference implementations, and compare them. Use this with your
+			own assets, like dle's img.raw, to validate a build.
+
+			@param src RGBA image
+			@param srcSize Size of the image
+			@param hashes If not NULL, receives the hash() of the optimized bake of
+			each stack, in order. Compare them with stored hashes to catch changes
+			of the output itself
+			@return true if every stack is within tolerance
+		*/
+		bool runGolden(const void* src, const Size& srcSize, const DifferentialOptions& options = DifferentialOptions(), std::vector<unsigned int>* hashes = NULL);
+
+		/**
+			Compare the non separable blend modes with a floating point version of
+			the W3C compositing formulas, on random opaque colors.
+
+			@return true if every channel is within 1 of the formulas
+		*/
+		bool runBlendModes(const DifferentialOptions& options = DifferentialOptions());
+
+		/**
+			Bake the distance field of an antialiased disc, render it back at
+			several downsamples and scales, and compare the alpha with a direct
+			bake of the disc at the render size.
+
+			@return true if every render is within tolerance
+		*/
+		bool runDistanceField(const DifferentialOptions& options = DifferentialOptions());
+
+		/**
+			Bake a few effect stacks with Layer::bakePreview, and compare them with
+			their full bake, downscaled. Their average error per channel must stay
+			within 4, with at most 1% of the pixels over 48.
+			Layer::bakeProgressive must give the same preview, then refine to
+			exactly the Layer::bake result.
+
+			@return true if every preview is within tolerance
+		*/
+		bool runPreview(const DifferentialOptions& options = DifferentialOptions());
+
+		/**
+			FNV-1a hash of a buffer
+		*/
+		unsigned int hash(const void* data, const int bytes);
+	}
+}
+
+#endif
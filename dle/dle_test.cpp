@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "dle_reference.h"
+
+// Hashes of the golden stacks of dle::reference::runGolden() on img.raw, in
+// order. Run with --update after an intended change of the output, and paste
+// the printed table here.
+static const unsigned int g_goldenHashes[] = {
+	0x24da1b6e,
+	0xfe762176,
+	0x52d51414,
+	0x8a7b6730,
+	0x108da61d,
+	0x861fd434,
+	0x0d561c6a,
+	0x036656ca,
+	0x18f0976c,
+};
+
+// Effect written against the original interface, with apply() only. The layer
+// is in dst when it runs
+class Invert : public dle::Effect {
+public:
+	void apply(dle::Color* baseLayer, dle::Color* dst, dle::Color* src, const dle::Size& srcSize) const {
+		for (int i = 0; i < srcSize.width * srcSize.height; ++i) {
+			dst[i].r = 255 - dst[i].r;
+			dst[i].g = 255 - dst[i].g;
+			dst[i].b = 255 - dst[i].b;
+		}
+	}
+};
+
+// Bake, background bakes, previews and animations run effects that only implement apply()
+static bool checkApplyOnlyEffect() {
+	const dle::Size size = { 37, 23 };
+	const int len = size.width * size.height;
+	std::vector<dle::Color> src(len), base(len, dle::Color{ 90, 120, 150, 255 }), expected(base);
+	for (int i = 0; i < len; ++i) {
+		src[i] = { (unsigned char) (i * 7), (unsigned char) (i * 13), (unsigned char) (i * 29), (unsigned char) (i * 3) };
+		const dle::Color inverted = { (unsigned char) (255 - src[i].r), (unsigned char) (255 - src[i].g), (unsigned char) (255 - src[i].b), src[i].a };
+		dle::blend(expected[i], expected[i], inverted, dle::kBlendMode_Normal);
+	}
+	dle::Layer layer(src.data(), size, dle::kBlendMode_Normal, Invert());
+
+	bool passed = true;
+	auto checkResult = [&](const char* name, const std::vector<dle::Color>& result) {
+		if (memcmp(result.data(), expected.data(), sizeof(dle::Color) * len)) {
+			printf("FAIL: apply() only effect, %s\n", name);
+			passed = false;
+		}
+	};
+
+	std::vector<dle::Color> result(base);
+	layer.bake(result.data());
+	checkResult("bake", result);
+
+	result = base;
+	dle::BakeJob job(layer, result.data());
+	while (!job.step(0.f)) {}
+	checkResult("BakeJob", result);
+
+	result = base;
+	layer.bakeAsync(result.data()).wait();
+	checkResult("bakeAsync", result);
+
+	result = base;
+	layer.bakePreview(result.data(), 1);
+	checkResult("bakePreview", result);
+
+	dle::Animation animation(layer);
+	animation.addKeyframe(4, Invert());
+	std::vector<dle::Color> frames(len * 6);
+	for (int f = 0; f < 6; ++f) std::copy(base.begin(), base.end(), frames.begin() + f * len);
+	animation.bake(frames.data(), 6);
+	for (int f = 0; f < 6; ++f) {
+		checkResult("Animation", std::vector<dle::Color>(frames.begin() + f * len, frames.begin() + (f + 1) * len));
+	}
+
+	if (passed) printf("PASS: apply() only effect\n");
+	return passed;
+}
+
+// Holds the effects that wait on it until it is released
+struct Gate {
+	std::atomic<bool> entered;
+	std::atomic<bool> released;
+	Gate() : entered(false), released(false) {}
+	void wait() {
+		entered = true;
+		while (!released) std::this_thread::yield();
+	}
+};
+
+// Records the order the scheduler runs the bakes in
+class Probe : public dle::Effect {
+public:
+	Probe(const int in_id, std::vector<int>* in_order, Gate* in_gate = NULL) : id(in_id), order(in_order), gate(in_gate) {}
+	void apply(dle::Color* baseLayer, dle::Color* dst, dle::Color* src, const dle::Size& srcSize) const {
+		order->push_back(id);
+		if (gate) gate->wait();
+	}
+	int id;
+	std::vector<int>* order;
+	Gate* gate;
+};
+
+// Two passes. Counts the rows of the first, and holds it on the gate
+class RowCounter : public dle::Effect {
+public:
+	RowCounter(Gate* in_gate, std::atomic<int>* in_rows, std::atomic<bool>* in_secondPass) : gate(in_gate), rows(in_rows), secondPass(in_secondPass) {}
+	dle::eEffectAccess getAccess() const { return dle::kEffectAccess_InPlace; }
+	int getPassCount() const { return 2; }
+	void applyRows(dle::Color* baseLayer, dle::Color* dst, dle::Color* src, dle::Color* scratch, const dle::Size& srcSize, const int pass, const int yStart, const int yEnd) const {
+		if (pass == 1) {
+			*secondPass = true;
+			return;
+		}
+		*rows += yEnd - yStart;
+		gate->wait();
+	}
+	Gate* gate;
+	std::atomic<int>* rows;
+	std::atomic<bool>* secondPass;
+};
+
+// Background bakes match Layer::bake, run by priority then submission order,
+// and stop when cancelled
+static bool checkBakeAsync() {
+	bool passed = true;
+	auto fail = [&](const char* what) {
+		printf("FAIL: bakeAsync, %s\n", what);
+		passed = false;
+	};
+
+	// Same result as Layer::bake
+	const dle::Size size = { 61, 47 };
+	const int len = size.width * size.height;
+	std::vector<dle::Color> src(len), base(len);
+	for (int i = 0; i < len; ++i) {
+		src[i] = { (unsigned char) (i * 7), (unsigned char) (i * 13), (unsigned char) (i * 29), (unsigned char) (i % 61 < 40 ? 255 : 0) };
+		base[i] = { (unsigned char) (i * 3), (unsigned char) (i * 5), (unsigned char) (i * 11), 255 };
+	}
+	dle::Layer layer(src.data(), size, dle::kBlendMode_Normal, dle::Shadow(), dle::Outline(), dle::InnerGlow());
+	for (int format = dle::kPixelFormat_RGBA; format <= dle::kPixelFormat_BGRA; ++format) {
+		std::vector<dle::Color> expected(base), result(base);
+		layer.bake(expected.data(), (dle::ePixelFormat) format);
+		dle::BakeHandle handle = layer.bakeAsync((void*) result.data(), (dle::ePixelFormat) format);
+		if (!handle.wait() || handle.getStatus() != dle::kBakeStatus_Done) fail("not done");
+		if (memcmp(result.data(), expected.data(), sizeof(dle::Color) * len)) fail("differs from bake");
+	}
+
+	// Hold the scheduler on a first bake, queue the others behind it
+	std::vector<int> order;
+	Gate gate;
+	std::vector<dle::Color> dst(len * 6, base[0]);
+	dle::Layer blocker(src.data(), size, dle::kBlendMode_Normal, Probe(0, &order, &gate));
+	dle::BakeHandle blockerHandle = blocker.bakeAsync(dst.data());
+	while (!gate.entered) std::this_thread::yield();
+	std::vector<std::unique_ptr<dle::Layer>> layers;
+	std::vector<dle::BakeHandle> handles;
+	const int priorities[] = { 0, 2, 1, 2, 5 };
+	for (int i = 0; i < 5; ++i) {
+		layers.emplace_back(new dle::Layer(src.data(), size, dle::kBlendMode_Normal, Probe(i + 1, &order)));
+		handles.push_back(layers.back()->bakeAsync(dst.data() + (i + 1) * len, priorities[i]));
+	}
+	handles[4].cancel();
+	if (handles[4].getStatus() != dle::kBakeStatus_Cancelled) fail("pending bake not cancelled");
+	gate.released = true;
+	blockerHandle.wait();
+	for (int i = 0; i < 4; ++i) {
+		if (!handles[i].wait()) fail("queued bake not done");
+	}
+	if (handles[4].wait()) fail("cancelled bake done");
+	const std::vector<int> expectedOrder = { 0, 2, 4, 3, 1 };
+	if (order != expectedOrder) fail("wrong priority order");
+
+	// Cancel a running bake in the middle of its first pass
+	const dle::Size tallSize = { 256, 8192 };
+	std::vector<dle::Color> tall(tallSize.width * tallSize.height, dle::Color{ 255, 255, 255, 255 });
+	Gate rowGate;
+	std::atomic<int> rows(0);
+	std::atomic<bool> secondPass(false);
+	dle::Layer tallLayer(tall.data(), tallSize, dle::kBlendMode_Normal, RowCounter(&rowGate, &rows, &secondPass));
+	std::vector<dle::Color> tallDst(tall.size());
+	dle::BakeHandle tallHandle = tallLayer.bakeAsync(tallDst.data());
+	while (!rowGate.entered) std::this_thread::yield();
+	tallHandle.cancel();
+	rowGate.released = true;
+	if (tallHandle.wait() || tallHandle.getStatus() != dle::kBakeStatus_Cancelled) fail("running bake not cancelled");
+	if (rows >= tallSize.height || secondPass) fail("running bake not stopped between chunks of rows");
+
+	if (passed) printf("PASS: bakeAsync\n");
+	return passed;
+}
+
+int main(int argc, char** argv) {
+	const char* imagePath = "img.raw";
+	bool update = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--update")) update = true;
+		else imagePath = argv[i];
+	}
+
+	bool passed = true;
+
+	// Random cases, a few seeds
+	dle::reference::DifferentialOptions options;
+	options.iterations = 100;
+	for (unsigned int seed = 1; seed <= 3; ++seed) {
+		options.seed = seed;
+		passed &= dle::reference::runDifferential(options);
+	}
+
+	passed &= checkApplyOnlyEffect();
+	passed &= checkBakeAsync();
+
+	// Non separable blend modes against the spec formulas
+	passed &= dle::reference::runBlendModes(options);
+
+	// Previews against downscaled full bakes
+	passed &= dle::reference::runPreview(options);
+
+	// Distance fields against direct bakes
+	passed &= dle::reference::runDistanceField(options);
+
+	// Golden stacks on dle's sample image
+	const dle::Size size = { 512, 512 };
+	std::vector<dle::Color> image(size.width * size.height);
+	FILE* pFic = fopen(imagePath, "rb");
+	if (!pFic || fread(image.data(), sizeof(dle::Color), image.size(), pFic) != image.size()) {
+		fprintf(stderr, "FAIL: can't read %s\n", imagePath);
+		if (pFic) fclose(pFic);
+		return 1;
+	}
+	fclose(pFic);
+
+	std::vector<unsigned int> hashes;
+	passed &= dle::reference::runGolden(image.data(), size, options, &hashes);
+
+	const size_t goldenCount = sizeof(g_goldenHashes) / sizeof(unsigned int);
+	if (update) {
+		for (auto hash : hashes) printf("\t0x%08x,\n", hash);
+	}
+	else if (hashes.size() != goldenCount) {
+		printf("FAIL: %d golden stacks, %d stored hashes\n", (int) hashes.size(), (int) goldenCount);
+		passed = false;
+	}
+	else {
+		for (size_t i = 0; i < goldenCount; ++i) {
+			if (hashes[i] != g_goldenHashes[i]) {
+				printf("FAIL: golden stack %d hashes to 0x%08x, expected 0x%08x\n", (int) i, hashes[i], g_goldenHashes[i]);
+				passed = false;
+			}
+		}
+	}
+
+	printf("%s\n", passed ? "PASS" : "FAIL");
+	return passed ? 0 : 1;
+}